@@ -3,207 +3,1178 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-
-#define SAFEALLOC(var,Type) if((var=(Type*)malloc(sizeof(Type)))==NULL)err("not enough memory");
-
-enum { ID, END, CT_INT, CT_REAL, STRING, ADD, SUB, MUL, DIV,
-    SEMICOLON, COMMA, LPAR, RPAR, LBRACKET, RBRACKET, LACC, RACC,
-    DOT, AND, OR, NOT, NEQUAL, EQUAL, ASSIGN, LESS, LESSEQ,
-    GREATER, GREATEREQ, BREAK, CHAR, DOUBLE, ELSE, FOR, IF, INT,
-    RETURN, STRUCT, VOID, WHILE, CT_CHAR };
-
-typedef struct _Token{
-    int code;
-    union {
-        char *text;
-        long int i;
-        double r;
-    };
-    int line;
-    struct _Token *next;
-} Token;
-
-typedef struct _Symbol Symbol;
-typedef struct{
-    Symbol **begin;     
-    Symbol **end;       
-    Symbol **after;     
-} Symbols;
-Symbols symbols;
-
-enum{TB_INT,TB_DOUBLE,TB_CHAR,TB_STRUCT,TB_VOID};
+#include <time.h>
+#include <limits.h>
+#include <math.h>                       // signbit and isinf only
+#include <pthread.h>
+#include <sched.h>
+#include "compiler.h"
+
+// --stats bookkeeping; costs a test of ctx->stats when the statistics are off
+#define STAT(ctx,what) if((ctx)->stats) (ctx)->stats->what
+#define COUNT_ALLOC(ctx,size) if((ctx)->stats){(ctx)->stats->allocs++;(ctx)->stats->allocBytes+=(size);}
+#define TRACE(ctx,name,start) if((ctx)->trace) traceEvent((ctx)->trace, (ctx)->traceTid, name, (ctx)->traceFile, start, seconds())
+#define ENTER_RULE(ctx) if((ctx)->stats && ++(ctx)->stats->depth > (ctx)->stats->maxDepth) (ctx)->stats->maxDepth = (ctx)->stats->depth
+
+#define LEX_BATCH 4096                  // streaming and pipelining: bytes of text lexed at a time
+#define INTERFACE_SUFFIX ".aif"        // interface file of an imported file: its name followed by this
+#define INTERFACE_VERSION 1
+#define STRING_BLOCK 65536              // bytes of string text allocated at a time
+#define PIPE_SIZE 64                    // pipelining: batches the lexer can be ahead of the parser
+#define MAX_FRAME (INT_MAX & ~15)       // largest frame, in bytes; padding it to its alignment keeps it in an int
+#ifndef LEX_CHUNK
+#define LEX_CHUNK 65536                 // parallel lexing: smallest chunk worth a thread, in bytes
+#endif
+
+#define SAFEALLOC(var,Type) if((var=(Type*)malloc(sizeof(Type)))==NULL)err(ctx, "not enough memory");COUNT_ALLOC(ctx,sizeof(Type))
+
+static Token *addTk(Context *ctx, int code, char *start, char *end);
+static void newLine(Context *ctx, char *start);
+static void err(Context *ctx, const char *fmt,...);
+static void tkerr(Context *ctx, const Token *tk,const char *fmt,...);
+static void lexerr(Context *ctx, const char *at, const char *fmt,...);
+static void addError(Context *ctx, int offset, int length, const char *fmt, va_list va);
+static void printSpan(Context *ctx, Span *span);
+static void moveError(Context *ctx, int i, int offset);
+static void resync(Context *ctx, int atTop);
+static void endDecl(Context *ctx, Symbol *func);
+static void freeDecls(Context *ctx);
+static void saveErrors(Context *ctx, Decl *d, int from, int n);
+static void keepErrors(Context *ctx, Decl *d);
+static int reparseFunc(Context *ctx, Decl *d);
+static void skipBody(Context *ctx);
+static int parseBody(Context *w, Decl *d, Context *ctx);
+static void *parseBodies(void *arg);
+static int mergeErrors(Context *ctx, char (*tail)[MAX_ERROR_LEN], Span *tailSpans, int nTail);
+static void markChanged(Context *ctx, Token *first, Token *next);
+static StringBlock *stringRoom(Context *ctx, int size);
+static StringSlot *findString(Strings *strings, const char *s, int length, unsigned hash);
+static void growStrings(Context *ctx, Strings *strings);
+static char *internString(Context *ctx, const char *start, const char *end, int escapes);
+static void takeStrings(Context *ctx, Strings *from);
+static void freeStrings(Strings *strings);
+static int keywordCode(const char *start, int len);
+static long intValue(const char *start, const char *end, int *overflow);
+static double realValue(const char *start, const char *end);
+static void traceString(FILE *out, const char *s);
+
+// Buffered output for token listings and dumps: one fwrite per WRITER_SIZE bytes.
+#define WRITER_SIZE 65536
 typedef struct{
-    int typeBase;   
-    Symbol *s;      
-    int nElements;  
-}Type;
-
-enum{CLS_VAR,CLS_FUNC,CLS_EXTFUNC,CLS_STRUCT};
-enum{MEM_GLOBAL,MEM_ARG,MEM_LOCAL};
-typedef struct _Symbol{
-    const char *name;       
-    int cls;                
-    int mem;                
-    Type type;
-    int depth;              
-    union{
-        Symbols args;       
-        Symbols members;    
-    };
-} Symbol;
-
-
-
-Token *addTk(int code);
-void err(const char *fmt,...);
-void tkerr(const Token *tk,const char *fmt,...);
-char *createString(const char* start, const char* end);
-char escapeCharacter(char ch);
-void printTokens();
-void generateTokens(char *input);
-int consume(int code);
-int unit();
-int declStruct();
-int declVar();
-int typeBase();
-int arrayDecl1();
-int arrayDecl();
-int typeName1();
-int declFunc();
-int funcArg();
-int stm();
-int stmCompound();
-int expr();
-int exprAssign();
-int exprOr();
-void exprOr1();
-int exprAnd();
-void exprAnd1();
-int exprEq();
-void exprEq1();
-int exprRel();
-void exprRel1();
-int exprAdd();
-void exprAdd1();
-int exprMul();
-void exprMul1();
-int exprCast();
-int exprUnary();
-int exprPostfix();
-void exprPostfix1();
-int exprPrimary();
-
-Token *lastToken = NULL, *tokens = NULL;
-Token *currentToken, *consumedTk;
-int line = 0;
-char *tokenNames[]={"ID", "END", "CT_INT", "CT_REAL", "STRING", "ADD", "SUB", "MUL", "DIV",
+    FILE *out;
+    int n;
+    char buf[WRITER_SIZE];
+} Writer;
+static void wrFlush(Writer *w);
+static void wrChar(Writer *w, char ch);
+static void wrBytes(Writer *w, const char *p, int n);
+static void wrStr(Writer *w, const char *s);
+static void wrLong(Writer *w, long v);
+static void wrFixed(Writer *w, double r);
+static void wrU32(Writer *w, unsigned v);
+static void wrU64(Writer *w, unsigned long long v);
+static char escapeCharacter(char ch);
+static int consume(Context *ctx, int code);
+static int lexFrom(Context *ctx, char *pCrtCh);
+static int lexRun(Context *ctx, char *pCrtCh);
+static void lexMore(Context *ctx);
+static Token *nextTk(Context *ctx, Token *tk);
+static void freeTokens(Token *tk, Token *to);
+static void *lexThread(void *arg);
+static int popBatch(Context *ctx);
+static void *countChunkLines(void *arg);
+static void *indexChunkLines(void *arg);
+static void *lexChunk(void *arg);
+static void dropTokens(Context *ctx);
+static int resynchronized(Context *ctx, int offset);
+void fixTokens(Context *ctx);
+static int declStruct(Context *ctx);
+static int declVar(Context *ctx);
+static int typeBase(Context *ctx, Type *ret);
+static int arrayDecl(Context *ctx, Type *ret);
+static int typeName1(Context *ctx, Type *ret);
+static int declFunc(Context *ctx);
+static int funcArg(Context *ctx);
+static int stm(Context *ctx);
+static int stmCompound(Context *ctx);
+static int expr(Context *ctx);
+static int exprAssign(Context *ctx);
+static int exprOr(Context *ctx);
+static void exprOr1(Context *ctx);
+static int exprAnd(Context *ctx);
+static void exprAnd1(Context *ctx);
+static int exprEq(Context *ctx);
+static void exprEq1(Context *ctx);
+static int exprRel(Context *ctx);
+static void exprRel1(Context *ctx);
+static int exprAdd(Context *ctx);
+static void exprAdd1(Context *ctx);
+static int exprMul(Context *ctx);
+static void exprMul1(Context *ctx);
+static int exprCast(Context *ctx);
+static int exprUnary(Context *ctx);
+static int exprPostfix(Context *ctx);
+static void exprPostfix1(Context *ctx, Type *t);
+static int exprPrimary(Context *ctx, Type *t);
+static unsigned hashName(const char *name);
+static void initSymbols(Symbols *symbols);
+static Symbol *addSymbol(Context *ctx, Symbols *symbols, const char *name, int cls);
+static Symbol *findSymbol(Symbols *symbols, const char *name);
+static Symbol *lookup(Context *ctx, const char *name);
+static void deleteSymbolsAfter(Symbols *symbols, Symbol *start);
+static void freeSymbol(Symbol *s);
+static void addVar(Context *ctx, Token *tkName, Type *t);
+static int typeSize(Type *t);
+static int typeAlign(Type *t);
+static int computeStructLayout(Context *ctx, Symbol *s);
+static int slotSize(Type *t, int mem);
+static int slotAlign(Type *t, int mem);
+static void startFrame(Context *ctx);
+static int frameSlot(Context *ctx, Type *t, int mem);
+static void endFrame(Symbol *func);
+static int frameArgs(Symbol *func);
+static Symbol *findMember(Symbol *s, const char *name);
+static int importDecl(Context *ctx);
+static void importFile(Context *ctx, Token *tk);
+static int compileImport(Context *ctx, Token *tk, const char *path, char *text, unsigned long long hash, char *clash, int clashSize);
+static int hashFile(const char *path, unsigned long long *hash);
+static void addImport(Context *ctx, const char *path, unsigned long long hash);
+static void freeImports(Context *ctx);
+static void writeInterface(Context *ctx, FILE *out, unsigned long long hash);
+static void wrName(Writer *w, const char *s);
+static void wrType(Writer *w, Type *t, Symbol **begin, Symbol **end);
+static int sameType(Type *a, Type *b);
+static int sameDeclaration(Symbol *a, Symbol *b);
+static int mapInterface(Context *ctx, int fd, unsigned long long hash, char *clash, int clashSize);
+static FILE *createInterface(const char *path, char *tmp, int *fd);
+static int loadCache(Context *ctx, int fd, unsigned long long hash);
+
+static char *tokenNames[]={"ID", "END", "CT_INT", "CT_REAL", "STRING", "ADD", "SUB", "MUL", "DIV",
                  "SEMICOLON", "COMMA", "LPAR", "RPAR", "LBRACKET", "RBRACKET", "LACC", "RACC",
                  "DOT", "AND", "OR", "NOT", "NEQUAL", "EQUAL", "ASSIGN", "LESS", "LESSEQ",
                  "GREATER", "GREATEREQ", "BREAK", "CHAR", "DOUBLE", "ELSE", "FOR", "IF", "INT",
                  "RETURN", "STRUCT", "VOID", "WHILE", "CT_CHAR"};
 
-void err(const char *fmt,...) {
+void printErrors(Context *ctx) {
+    int i;
+    for(i = 0; i < ctx->nErrors; i++) {
+        fputs(ctx->errors[i], stderr);
+        if(ctx->errorSpans[i].offset >= 0) printSpan(ctx, &ctx->errorSpans[i]);
+    }
+}
+
+void findPosition(Context *ctx, int offset, int *line, int *column) {
+    int lo = 0, hi = ctx->line, mid;
+    while(lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if(ctx->lineStarts[mid] <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    *line = lo + 1;
+    *column = offset - ctx->lineStarts[lo] + 1;
+}
+
+// Prints the line the span starts on and underlines the span (up to the end of that line).
+static void printSpan(Context *ctx, Span *span) {
+    int line, column, i;
+    const char *start, *p;
+    findPosition(ctx, span->offset, &line, &column);
+    start = ctx->text + ctx->lineStarts[line - 1];
+    for(p = start; *p != '\0' && *p != '\n' && *p != '\r'; p++);
+    fprintf(stderr, "    %.*s\n    ", (int)(p - start), start);
+    for(i = 0; i < column - 1; i++) fputc(start + i < p && start[i] == '\t' ? '\t' : ' ', stderr);
+    fputc('^', stderr);
+    for(i = 1; i < span->length && start + column - 1 + i < p; i++) fputc('~', stderr);
+    fputc('\n', stderr);
+}
+
+// Stores the message; a full buffer ends the current generateTokens/unit call with RES_TOO_MANY_ERRORS.
+static void addError(Context *ctx, int offset, int length, const char *fmt, va_list va) {
+    int line, column, n;
+    findPosition(ctx, offset, &line, &column);
+    n = snprintf(ctx->errors[ctx->nErrors], MAX_ERROR_LEN - 1, "error in line %d, column %d: ", line, column);
+    ctx->errorSpans[ctx->nErrors].offset = offset;
+    ctx->errorSpans[ctx->nErrors].length = length;
+    vsnprintf(ctx->errors[ctx->nErrors] + n, MAX_ERROR_LEN - 1 - n, fmt, va);
+    strcat(ctx->errors[ctx->nErrors], "\n");
+    if(++ctx->nErrors == MAX_ERRORS) longjmp(ctx->fatal, RES_TOO_MANY_ERRORS);
+}
+
+// Gives error i the span offset, after the text moved, and the line and column there.
+static void moveError(Context *ctx, int i, int offset) {
+    char msg[MAX_ERROR_LEN];
+    const char *old = strchr(ctx->errors[i], ':');
+    int line, column, n;
+    snprintf(msg, sizeof(msg), "%s", old ? old + 2 : "");
+    if((n = strlen(msg)) > 0 && msg[n - 1] == '\n') msg[n - 1] = '\0';       // messages can hold a '\n' of the text
+    findPosition(ctx, offset, &line, &column);
+    n = snprintf(ctx->errors[i], MAX_ERROR_LEN - 1, "error in line %d, column %d: ", line, column);
+    strncat(ctx->errors[i], msg, MAX_ERROR_LEN - 2 - n);
+    strcat(ctx->errors[i], "\n");
+    ctx->errorSpans[i].offset = offset;
+}
+
+// Unrecoverable errors: the message takes the next slot (or the last one when full)
+// and the current generateTokens/unit call returns RES_FATAL.
+static void err(Context *ctx, const char *fmt,...) {
     va_list va;
+    int i = ctx->nErrors < MAX_ERRORS ? ctx->nErrors++ : MAX_ERRORS - 1;
+    char *msg = ctx->errors[i];
+    int n = snprintf(msg, MAX_ERROR_LEN - 1, "error: ");
+    ctx->errorSpans[i].offset = -1;
     va_start(va,fmt);
-    fprintf(stderr,"error: ");
-    vfprintf(stderr,fmt,va);
-    fputc('\n',stderr);
+    vsnprintf(msg + n, MAX_ERROR_LEN - 1 - n, fmt, va);
     va_end(va);
-    exit(-1);
+    strcat(msg, "\n");
+    longjmp(ctx->fatal, RES_FATAL);
 }
 
-void tkerr(const Token *tk,const char *fmt,...) {
+// Records the error and unwinds to the innermost recovery point (unit, declStruct, stmCompound).
+static void tkerr(Context *ctx, const Token *tk,const char *fmt,...) {
     va_list va;
     va_start(va,fmt);
-    fprintf(stderr,"error in line %d: ",tk->line);
-    vfprintf(stderr,fmt,va);
-    fputc('\n',stderr);
+    addError(ctx, tk->offset, tk->length, fmt, va);
     va_end(va);
-    exit(-1);
+    if(ctx->recoverPoint) longjmp(*ctx->recoverPoint, 1);
+    longjmp(ctx->fatal, RES_ERRORS);
+}
+
+// Lexical errors are recorded and the lexer carries on from the next character.
+static void lexerr(Context *ctx, const char *at, const char *fmt,...) {
+    va_list va;
+    va_start(va,fmt);
+    addError(ctx, at - ctx->text, 1, fmt, va);
+    va_end(va);
+}
+
+Context *createContext() {
+    Context *ctx = (Context*)calloc(1, sizeof(Context));
+    if(ctx) {
+        initSymbols(&ctx->symbols);
+        ctx->changed = CHANGED_ALL;
+    }
+    return ctx;
+}
+
+static void freeSymbol(Symbol *s) {
+    Symbol **p;
+    if(s->cls != CLS_VAR) {
+        for(p = s->members.begin; p != s->members.end; p++) freeSymbol(*p);
+        free(s->members.begin);
+    }
+    free(s->index);
+    free((char*)s->name);
+    free(s);
+}
+
+// Frees the tokens from tk up to, but not including, to.
+static void freeTokens(Token *tk, Token *to) {
+    Token *next;
+    for(; tk != to; tk = next) {
+        next = tk->next;
+        free(tk);
+    }
+}
+
+void freeContext(Context *ctx) {
+    freeTokens(ctx->tokens, NULL);
+    deleteSymbolsAfter(&ctx->symbols, NULL);
+    free(ctx->symbols.begin);
+    freeDecls(ctx);
+    free(ctx->decls);
+    freeStrings(&ctx->strings);
+    freeImports(ctx);
+    free(ctx->imports);
+    free(ctx->lineStarts);
+    if(ctx->ownsText) free(ctx->text);
+    free(ctx);
 }
 
-Token *addTk(int code) {
+static Token *addTk(Context *ctx, int code, char *start, char *end) {
     Token *tk;
     SAFEALLOC(tk,Token);
     tk->code = code;
-    tk->line = line;
+    STAT(ctx, tokens[code]++);
+    tk->offset = start - ctx->text;
+    tk->length = end - start;
+    tk->line = ctx->line + 1;
     tk->next = NULL;
-    if (lastToken) {
-        lastToken->next = tk;
+    if (ctx->lastToken) {
+        ctx->lastToken->next = tk;
     } else {
-        tokens = tk;
+        ctx->tokens = tk;
     }
-    lastToken = tk;
+    ctx->lastToken = tk;
     return tk;
 }
 
-char* createString(const char* start, const char* end) {
-    int len = end - start + 1;
-    char *ret = (char*)malloc(sizeof(char) * len);
-    snprintf(ret, len, "%s", start);
-    return ret;
+// The lexer calls it for every '\n'; start is the first character of the next line.
+static void newLine(Context *ctx, char *start) {
+    int *lineStarts;
+    if(ctx->linesKnown) {
+        ctx->line++;
+        return;
+    }
+    if(++ctx->line == ctx->maxLines) {
+        int max = ctx->maxLines * 2;
+        if((lineStarts = (int*)realloc(ctx->lineStarts, max * sizeof(int))) == NULL) err(ctx, "not enough memory");
+        COUNT_ALLOC(ctx, max * sizeof(int));
+        ctx->lineStarts = lineStarts;
+        ctx->maxLines = max;
+    }
+    ctx->lineStarts[ctx->line] = start - ctx->text;
+}
+
+struct _StringBlock{
+    StringBlock *next;
+    int size, used;                 // bytes of data, and how many of them hold strings
+    char data[];
+};
+
+struct _StringSlot{
+    char *s;                        // NULL: free
+    unsigned hash;                  // hashName(s)
+    int length;
+};
+
+// Makes room for a string of size bytes, '\0' included, in the first block.
+static StringBlock *stringRoom(Context *ctx, int size) {
+    StringBlock *b = ctx->strings.blocks;
+    if(b && b->size - b->used >= size) return b;
+    if(size < STRING_BLOCK) size = STRING_BLOCK;
+    if((b = (StringBlock*)malloc(sizeof(StringBlock) + size)) == NULL) err(ctx, "not enough memory");
+    COUNT_ALLOC(ctx, sizeof(StringBlock) + size);
+    b->next = ctx->strings.blocks;
+    b->size = size;
+    b->used = 0;
+    ctx->strings.blocks = b;
+    return b;
+}
+
+// The slot of the string s (length bytes, with that hash), or the free one where it would go.
+static StringSlot *findString(Strings *strings, const char *s, int length, unsigned hash) {
+    StringSlot *slot;
+    unsigned i;
+    for(i = hash; ; i++) {
+        slot = &strings->slots[i & (strings->nSlots - 1)];
+        if(slot->s == NULL) return slot;
+        if(slot->hash == hash && slot->length == length && !memcmp(slot->s, s, length)) return slot;
+    }
+}
+
+// Doubles the hash table once it is half full, so that one more string always fits.
+static void growStrings(Context *ctx, Strings *strings) {
+    StringSlot *old = strings->slots, *slot;
+    int n = strings->nSlots, i;
+    if(2 * (strings->nStrings + 1) <= n) return;
+    strings->nSlots = n ? 2 * n : 256;
+    if((strings->slots = (StringSlot*)calloc(strings->nSlots, sizeof(StringSlot))) == NULL) err(ctx, "not enough memory");
+    COUNT_ALLOC(ctx, strings->nSlots * sizeof(StringSlot));
+    for(i = 0; i < n; i++) {
+        if(old[i].s == NULL) continue;
+        slot = findString(strings, old[i].s, old[i].length, old[i].hash);
+        *slot = old[i];
+    }
+    free(old);
+}
+
+// The text start..end as a string of ctx->strings, with its escape sequences decoded when
+// escapes is set. It is decoded and hashed in one pass, straight into the free space of
+// the first block, which it only takes when the string is not there already.
+static char *internString(Context *ctx, const char *start, const char *end, int escapes) {
+    StringBlock *b = stringRoom(ctx, end - start + 1);
+    StringSlot *slot;
+    char *s = b->data + b->used, *q = s, c;
+    unsigned h = 2166136261u;
+    for(; start < end; start++) {
+        c = *start;
+        if(c == '\\' && escapes && start + 1 < end) c = escapeCharacter(*++start);
+        *q++ = c;
+        h ^= (unsigned char)c;
+        h *= 16777619u;
+    }
+    *q = '\0';
+    growStrings(ctx, &ctx->strings);
+    slot = findString(&ctx->strings, s, q - s, h);
+    if(slot->s == NULL) {
+        slot->s = s;
+        slot->hash = h;
+        slot->length = q - s;
+        ctx->strings.nStrings++;
+        b->used += q - s + 1;
+    }
+    return slot->s;
+}
+
+// Hands the strings of from over to ctx, whose tokens now point to them. Those that ctx
+// does not have yet go in its hash table as well.
+static void takeStrings(Context *ctx, Strings *from) {
+    StringBlock **b;
+    StringSlot *slot;
+    int i;
+    if(ctx->strings.nStrings == 0) {
+        freeStrings(&ctx->strings);
+        ctx->strings = *from;
+        memset(from, 0, sizeof(Strings));
+        return;
+    }
+    for(b = &from->blocks; *b != NULL; b = &(*b)->next);
+    *b = ctx->strings.blocks;
+    ctx->strings.blocks = from->blocks;
+    for(i = 0; i < from->nSlots; i++) {
+        if(from->slots[i].s == NULL) continue;
+        growStrings(ctx, &ctx->strings);
+        slot = findString(&ctx->strings, from->slots[i].s, from->slots[i].length, from->slots[i].hash);
+        if(slot->s == NULL) {
+            *slot = from->slots[i];
+            ctx->strings.nStrings++;
+        }
+    }
+    free(from->slots);
+    memset(from, 0, sizeof(Strings));
 }
 
-char escapeCharacter(char ch) {
-    switch(ch) {
-        case 'a': return '\a';
-        case 'b': return '\b';
-        case 'f': return '\f';
-        case 'n': return '\n';
-        case 'r': return '\r';
-        case 't': return '\t';
-        case '?': return '\?';
-        case '"': return '\"';
-        case '0': return '\0';
-        case '\'': return '\'';
-        case '\\': return '\\';
+static void freeStrings(Strings *strings) {
+    StringBlock *b, *next;
+    for(b = strings->blocks; b != NULL; b = next) {
+        next = b->next;
+        free(b);
     }
-    return ch;
+    free(strings->slots);
+    memset(strings, 0, sizeof(Strings));
 }
 
-void printTokens() {
-    Token *current = tokens;
-    while(current != NULL) {
-        printf("%s", tokenNames[current->code]);
+// BREAK..WHILE when the len characters at start spell a keyword, else ID
+static int keywordCode(const char *start, int len) {
+    static const char *keywords[] = {"break", "char", "double", "else", "for", "if", "int",
+                                     "return", "struct", "void", "while"};
+    int i;
+    for(i = 0; i <= WHILE - BREAK; i++) {
+        if(!strncmp(start, keywords[i], len) && keywords[i][len] == '\0') return BREAK + i;
+    }
+    return ID;
+}
+
+// Value of the integer constant start..end: decimal, octal after a leading 0, hex after
+// 0x. Reads nothing past end. When it does not fit in a long, *overflow is set and the
+// value is LONG_MAX, as from strtol.
+static long intValue(const char *start, const char *end, int *overflow) {
+    unsigned long v = 0, max = LONG_MAX;
+    int base = 10, d;
+    *overflow = 0;
+    if(end - start > 1 && start[0] == '0') {
+        start++;
+        base = 8;
+        if(*start == 'x' || *start == 'X') {
+            start++;
+            base = 16;
+        }
+    }
+    for(; start < end; start++) {
+        if(*start <= '9') d = *start - '0';
+        else d = (*start | 0x20) - 'a' + 10;
+        if(v > (max - d) / base) {
+            *overflow = 1;
+            return LONG_MAX;
+        }
+        v = v * base + d;
+    }
+    return (long)v;
+}
+
+// Value of the real constant start..end: digits, then maybe a fraction and an exponent
+// (whose digits may be missing after a lexical error). With at most 19 significant digits
+// and a value that is an integer below 2^53 times or over an exact power of 10, one
+// multiplication or division gives the correctly rounded result (Clinger's fast path).
+// Anything else goes to strtod, on a copy of the slice when it is short.
+static double realValue(const char *start, const char *end) {
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    unsigned long long m = 0;
+    const char *p = start;
+    char copy[64];
+    int digits = 0, exp10 = 0, e = 0, negative = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; p++) {
+        if(m || *p != '0') {
+            m = m * 10 + (*p - '0');
+            digits++;
+        }
+        if(digits > 19) goto slow;
+    }
+    if(p < end && *p == '.') {
+        for(p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if(m || *p != '0') {
+                m = m * 10 + (*p - '0');
+                digits++;
+            }
+            exp10--;
+            if(digits > 19) goto slow;
+        }
+    }
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if(p < end && (*p == '+' || *p == '-')) negative = *p++ == '-';
+        for(; p < end && e < 10000; p++) e = e * 10 + (*p - '0');
+        if(p < end) goto slow;
+        exp10 += negative ? -e : e;
+    }
+    if(m == 0) return 0;
+    if(m <= (1ULL << 53)) {
+        if(exp10 < 0 && exp10 >= -22) return (double)m / powers[-exp10];
+        // 12e25: 12000 is still exact, and then one multiplication by 1e22
+        for(; exp10 > 22 && m <= (1ULL << 53) / 10; exp10--) m *= 10;
+        if(exp10 >= 0 && exp10 <= 22) return (double)m * powers[exp10];
+    }
+slow:
+    if(end - start < (int)sizeof(copy)) {
+        memcpy(copy, start, end - start);
+        copy[end - start] = '\0';
+        return strtod(copy, NULL);
+    }
+    return strtod(start, NULL);
+}
+
+// Value of the escape sequence \ch. Invalid ones, already reported by the lexer, stand
+// for ch itself.
+static char escapeCharacter(char ch) {
+    static const char escapes[256] = {['a'] = '\a', ['b'] = '\b', ['f'] = '\f', ['n'] = '\n',
+        ['r'] = '\r', ['t'] = '\t', ['v'] = '\v', ['?'] = '\?', ['"'] = '\"', ['\''] = '\'',
+        ['\\'] = '\\'};
+    char c = escapes[(unsigned char)ch];
+    return c || ch == '0' ? c : ch;
+}
+
+static void wrFlush(Writer *w) {
+    fwrite(w->buf, 1, w->n, w->out);
+    w->n = 0;
+}
+
+static void wrChar(Writer *w, char ch) {
+    if(w->n == WRITER_SIZE) wrFlush(w);
+    w->buf[w->n++] = ch;
+}
+
+static void wrBytes(Writer *w, const char *p, int n) {
+    int k;
+    while(n > 0) {
+        if(w->n == WRITER_SIZE) wrFlush(w);
+        k = WRITER_SIZE - w->n < n ? WRITER_SIZE - w->n : n;
+        memcpy(w->buf + w->n, p, k);
+        w->n += k;
+        p += k;
+        n -= k;
+    }
+}
+
+static void wrStr(Writer *w, const char *s) {
+    wrBytes(w, s, strlen(s));
+}
+
+static void wrLong(Writer *w, long v) {
+    char digits[24], *p = digits + sizeof(digits);
+    unsigned long u = v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while(u);
+    if(v < 0) *--p = '-';
+    wrBytes(w, p, digits + sizeof(digits) - p);
+}
+
+// Same text as printf("%f"). The product below is off by less than 1e-5 for
+// |r| < 1e5, so the rounding to 6 decimals is right unless the value is close to
+// half way; those, and larger values, go through snprintf.
+static void wrFixed(Writer *w, double r) {
+    double scaled = (signbit(r) ? -r : r) * 1e6, half;
+    char text[512];
+    long m;
+    int i;
+    if(scaled < 1e11) {
+        m = (long)scaled;
+        half = scaled - m - 0.5;
+        if(half > 1e-4 || half < -1e-4) {
+            if(half > 0) m++;
+            if(signbit(r)) wrChar(w, '-');
+            wrLong(w, m / 1000000);
+            wrChar(w, '.');
+            for(i = 100000; i >= 1; i /= 10) wrChar(w, '0' + m / i % 10);
+            return;
+        }
+    }
+    wrBytes(w, text, snprintf(text, sizeof(text), "%f", r));
+}
+
+// little endian, whatever the host
+static void wrU32(Writer *w, unsigned v) {
+    int i;
+    for(i = 0; i < 4; i++) wrChar(w, (v >> (8 * i)) & 0xFF);
+}
+
+static void wrU64(Writer *w, unsigned long long v) {
+    int i;
+    for(i = 0; i < 8; i++) wrChar(w, (v >> (8 * i)) & 0xFF);
+}
+
+void printTokens(Context *ctx) {
+    Token *current;
+    Writer w;
+    fixTokens(ctx);
+    w.out = stdout;
+    w.n = 0;
+    for(current = ctx->tokens; current != NULL; current = current->next) {
+        wrStr(&w, tokenNames[current->code]);
         switch(current->code) {
             case ID:
             case STRING:
-                printf(":%s", current->text);
+                wrChar(&w, ':');
+                wrStr(&w, current->text);
                 break;
             case CT_CHAR:
-                printf(":%c", (int)current->i);
+                wrChar(&w, ':');
+                wrChar(&w, (char)current->i);
+                break;
+            case CT_INT:
+                wrChar(&w, ':');
+                wrLong(&w, current->i);
+                break;
+            case CT_REAL:
+                wrChar(&w, ':');
+                wrFixed(&w, current->r);
+                break;
+        }
+        wrChar(&w, ' ');
+    }
+    wrStr(&w, "\nLines of code: ");
+    wrLong(&w, ctx->line);
+    wrChar(&w, '\n');
+    wrFlush(&w);
+}
+
+// Binary token dump, all numbers little endian:
+//     "ATKD", version (1 byte), number of token codes (1 byte), their names, each ending in NUL
+//     then per token: code (1 byte), line (u32, from 1), offset (u32), length (u32) and
+//         ID, STRING: byte count (u32) and the bytes
+//         CT_INT, CT_CHAR: the value (u64, two's complement)
+//         CT_REAL: the IEEE 754 double (u64)
+// The END token is the last one.
+void dumpTokens(Context *ctx, FILE *out) {
+    Token *tk;
+    Writer w;
+    unsigned long long bits;
+    int i, n;
+    fixTokens(ctx);
+    w.out = out;
+    w.n = 0;
+    wrStr(&w, "ATKD");
+    wrChar(&w, 1);
+    wrChar(&w, CT_CHAR + 1);
+    for(i = 0; i <= CT_CHAR; i++) wrBytes(&w, tokenNames[i], strlen(tokenNames[i]) + 1);
+    for(tk = ctx->tokens; tk != NULL; tk = tk->next) {
+        wrChar(&w, tk->code);
+        wrU32(&w, tk->line);
+        wrU32(&w, tk->offset);
+        wrU32(&w, tk->length);
+        switch(tk->code) {
+            case ID:
+            case STRING:
+                n = strlen(tk->text);
+                wrU32(&w, n);
+                wrBytes(&w, tk->text, n);
                 break;
             case CT_INT:
-                printf(":%d",current->i);
+            case CT_CHAR:
+                wrU64(&w, (unsigned long long)tk->i);
                 break;
             case CT_REAL:
-                printf(":%f", current->r);
+                memcpy(&bits, &tk->r, sizeof(bits));
+                wrU64(&w, bits);
                 break;
         }
-        printf(" ");
-        current = current->next;
     }
-    printf("\nLines of code: %i\n", line);
+    wrFlush(&w);
+}
+
+void printStats(Context *ctx) {
+    Stats *st = ctx->stats;
+    static const char *backtrackNames[] = {"declStruct", "declFunc", "exprAssign", "exprCast", "exprPrimary"};
+    long total = 0;
+    int i;
+    fprintf(stderr, "time (ms): read %.3f, lex %.3f, parse %.3f\n",
+        st->readTime * 1e3, st->lexTime * 1e3, st->parseTime * 1e3);
+    if(st->lexWait || st->parseWait) {
+        fprintf(stderr, "pipeline stalls (ms): lexer waited %.3f, parser waited %.3f\n", st->lexWait * 1e3, st->parseWait * 1e3);
+    }
+    if(st->chunks) fprintf(stderr, "parallel lexing: %d chunks, %d lexed again\n", st->chunks, st->chunksRelexed);
+    if(st->imports) fprintf(stderr, "imports: %d, %d of them compiled\n", st->imports, st->importsCompiled);
+    if(st->bodies || st->fallbacks) fprintf(stderr, "parallel parsing: %d function bodies, %d times parsed again with unit()\n", st->bodies, st->fallbacks);
+    for(i = 0; i < st->nWorkers; i++) {
+        fprintf(stderr, "    thread %-3d %6d bodies, busy %.3f ms (%.0f%%)\n", i, st->workerJobs[i], st->workerBusy[i] * 1e3,
+            st->workerWall > 0 ? 100 * st->workerBusy[i] / st->workerWall : 0);
+    }
+    for(i = 0; i <= CT_CHAR; i++) total += st->tokens[i];
+    fprintf(stderr, "tokens: %ld\n", total);
+    for(i = 0; i <= CT_CHAR; i++) {
+        if(st->tokens[i]) fprintf(stderr, "    %-10s %ld\n", tokenNames[i], st->tokens[i]);
+    }
+    fprintf(stderr, "backtracks:");
+    for(i = 0; i < BT_N; i++) fprintf(stderr, " %s %ld%s", backtrackNames[i], st->backtracks[i], i < BT_N - 1 ? "," : "\n");
+    fprintf(stderr, "max nesting of statements and expressions: %d\n", st->maxDepth);
+    fprintf(stderr, "allocations: %ld, %ld bytes\n", st->allocs, st->allocBytes);
+}
+
+void printFrames(Context *ctx) {
+    Symbol **p;
+    for(p = ctx->symbols.begin; p != ctx->symbols.end; p++) {
+        if((*p)->cls != CLS_FUNC || (*p)->imported) continue;
+        printf("frame %s: %d bytes, arguments %d, aligned to %d\n", (*p)->name, (*p)->size, frameArgs(*p), (*p)->align);
+    }
 }
 
 
 // Lexical Analysis
 
-void generateTokens(char *input) {
-    int state = 0;
+double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+Trace *openTrace(const char *path) {
+    Trace *trace = (Trace*)calloc(1, sizeof(Trace));
+    if(trace == NULL) return NULL;
+    if((trace->out = fopen(path, "w")) == NULL) {
+        free(trace);
+        return NULL;
+    }
+    trace->start = seconds();
+    fputs("[\n", trace->out);
+    return trace;
+}
+
+void closeTrace(Trace *trace) {
+    fputs("\n]\n", trace->out);
+    fclose(trace->out);
+    free(trace);
+}
+
+// writes s as the inside of a JSON string
+static void traceString(FILE *out, const char *s) {
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if((unsigned char)*s < ' ') fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+}
+
+// The stream lock keeps the events of different threads whole.
+void traceEvent(Trace *trace, int tid, const char *name, const char *file, double start, double end) {
+    FILE *out = trace->out;
+    flockfile(out);
+    fputs(trace->nEvents++ ? ",\n{\"name\":\"" : "{\"name\":\"", out);
+    traceString(out, name);
+    fprintf(out, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+        tid, (start - trace->start) * 1e6, (end - start) * 1e6);
+    if(file) {
+        fputs(",\"args\":{\"file\":\"", out);
+        traceString(out, file);
+        fputs("\"}", out);
+    }
+    fputc('}', out);
+    funlockfile(out);
+}
+
+int generateTokens(Context *ctx, char *input) {
+    double start = ctx->stats || ctx->trace ? seconds() : 0;
+    int res;
+    ctx->text = input;
+    if(ctx->lineStarts == NULL) {
+        if((ctx->lineStarts = (int*)malloc(64 * sizeof(int))) == NULL) return RES_FATAL;
+        COUNT_ALLOC(ctx, 64 * sizeof(int));
+        ctx->maxLines = 64;
+    }
+    ctx->line = 0;
+    ctx->lineStarts[0] = 0;
+    res = lexFrom(ctx, input);
+    STAT(ctx, lexTime += seconds() - start);
+    TRACE(ctx, "lex", start);
+    return res;
+}
+
+int streamTokens(Context *ctx, char *input) {
+    ctx->streaming = 1;
+    ctx->lexPos = input;
+    return generateTokens(ctx, input);
+}
+
+// Lexes from pCrtCh on; a fatal error ends it with its RES_ code.
+static int lexFrom(Context *ctx, char *pCrtCh) {
+    int res;
+    if((res = setjmp(ctx->fatal)) != 0) {
+        ctx->nLexErrors = ctx->nErrors;
+        return res;
+    }
+    return lexRun(ctx, pCrtCh);
+}
+
+// Streaming: lexes the next batch of tokens. Called from the parser, so a fatal error
+// goes to the handler unit() has set.
+static void lexMore(Context *ctx) {
+    double start = ctx->stats ? seconds() : 0;
+    lexRun(ctx, ctx->lexPos);
+    STAT(ctx, lexTime += seconds() - start);
+}
+
+// The token after tk. Once the parser reaches the last token, a streaming context lexes
+// more and a pipelined one waits for the lexer thread.
+static Token *nextTk(Context *ctx, Token *tk) {
+    if(tk == ctx->lastToken && tk->code != END) {
+        if(ctx->pipe) {
+            if(!popBatch(ctx)) longjmp(ctx->fatal, RES_FATAL);
+        } else if(ctx->lexPos) lexMore(ctx);
+    }
+    return tk->next;
+}
+
+// Lexer/parser pipelining. The lexer thread has a context of its own, for its tokens,
+// errors and statistics, and hands the parser batches of tokens through a ring with
+// one writer per counter. The parser follows next pointers only up to the end of the
+// last batch it took, so it never reads a token the lexer is still linking.
+struct _Pipe{
+    Context *lex;
+    Token *ends[PIPE_SIZE];             // last token of each batch
+    int lines[PIPE_SIZE];               // lex->line after that batch
+    unsigned head, tail;                // batches pushed by the lexer and popped by the parser
+    int done, res;                      // set by the lexer when it stops, with its RES_ code
+    double lexWait, parseWait;          // seconds each side waited for the other
+};
+
+static void *lexThread(void *arg) {
+    Pipe *pipe = (Pipe*)arg;
+    Context *lex = pipe->lex;
+    double start = lex->stats || lex->trace ? seconds() : 0, wait;
+    unsigned head = 0;
+    int res = RES_OK;
+    while(lex->lexPos) {
+        res = lexFrom(lex, lex->lexPos);
+        if(res != RES_OK && res != RES_ERRORS) break;
+        if(head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) == PIPE_SIZE) {
+            wait = seconds();
+            while(head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) == PIPE_SIZE) sched_yield();
+            pipe->lexWait += seconds() - wait;
+        }
+        pipe->ends[head % PIPE_SIZE] = lex->lastToken;
+        pipe->lines[head % PIPE_SIZE] = lex->line;
+        __atomic_store_n(&pipe->head, ++head, __ATOMIC_RELEASE);
+    }
+    pipe->res = res;
+    __atomic_store_n(&pipe->done, 1, __ATOMIC_RELEASE);
+    STAT(lex, lexTime += seconds() - start - pipe->lexWait);
+    TRACE(lex, "lex", start);
+    return NULL;
+}
+
+// Parser side: takes the next batch, waiting for it if needed. Returns 0 when the
+// lexer stopped without reaching END.
+static int popBatch(Context *ctx) {
+    Pipe *pipe = ctx->pipe;
+    unsigned tail = pipe->tail;
+    double start;
+    if(__atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == tail) {
+        start = seconds();
+        while(__atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == tail) {
+            if(__atomic_load_n(&pipe->done, __ATOMIC_ACQUIRE) && __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == tail) return 0;
+            sched_yield();
+        }
+        pipe->parseWait += seconds() - start;
+    }
+    ctx->lastToken = pipe->ends[tail % PIPE_SIZE];
+    ctx->line = pipe->lines[tail % PIPE_SIZE];
+    __atomic_store_n(&pipe->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int pipelineUnit(Context *ctx, char *input) {
+    Pipe pipe;
+    Stats lexStats;
+    pthread_t thread;
+    Context *lex;
+    char *p;
+    int lines = 0, res, n, keep, i;
+
+    if(ctx->cached) return RES_INVALID;
+    if((lex = createContext()) == NULL) return RES_FATAL;
+    // room for every line up front, so the lexer never moves the index the parser reads
+    for(p = input; (p = strchr(p, '\n')) != NULL; p++) lines++;
+    free(ctx->lineStarts);
+    if((ctx->lineStarts = (int*)malloc((lines + 2) * sizeof(int))) == NULL) {
+        freeContext(lex);
+        return RES_FATAL;
+    }
+    COUNT_ALLOC(ctx, (lines + 2) * sizeof(int));
+    ctx->maxLines = lines + 2;
+    ctx->lineStarts[0] = 0;
+    ctx->line = 0;
+    ctx->text = input;
+    lex->text = input;
+    lex->lineStarts = ctx->lineStarts;
+    lex->maxLines = ctx->maxLines;
+    lex->lexPos = input;
+    lex->trace = ctx->trace;
+    lex->traceTid = ctx->traceTid + PIPE_TID;
+    lex->traceFile = ctx->traceFile;
+    if(ctx->stats) {
+        memset(&lexStats, 0, sizeof(lexStats));
+        lex->stats = &lexStats;
+    }
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.lex = lex;
+    if(pthread_create(&thread, NULL, lexThread, &pipe) != 0) {
+        lex->lineStarts = NULL;
+        freeContext(lex);
+        res = generateTokens(ctx, input);
+        if(res == RES_OK || res == RES_ERRORS) res = unit(ctx);
+        return res;
+    }
+
+    ctx->pipe = &pipe;
+    if(popBatch(ctx)) {
+        ctx->tokens = lex->tokens;
+        res = unit(ctx);
+    } else res = RES_FATAL;
+    // generateTokens would have lexed it all, errors included, whatever the parse did
+    while(ctx->lastToken && ctx->lastToken->code != END && popBatch(ctx));
+    ctx->pipe = NULL;
+    pthread_join(thread, NULL);
+
+    // leave the context as generateTokens followed by unit would: lexical errors first
+    ctx->tokens = lex->tokens;
+    ctx->lastToken = lex->lastToken;
+    ctx->line = lex->line;
+    lex->tokens = NULL;
+    lex->lineStarts = NULL;
+    takeStrings(ctx, &lex->strings);
+    n = lex->nErrors;
+    if(pipe.res != RES_OK && pipe.res != RES_ERRORS) {
+        ctx->nErrors = 0;               // unit would not have run
+        res = pipe.res;
+    } else if(n) {
+        keep = ctx->nErrors < MAX_ERRORS - n ? ctx->nErrors : MAX_ERRORS - n;
+        if(n + ctx->nErrors >= MAX_ERRORS && res != RES_FATAL) res = RES_TOO_MANY_ERRORS;
+        else if(res == RES_OK) res = RES_ERRORS;
+        memmove(ctx->errors + n, ctx->errors, keep * MAX_ERROR_LEN);
+        memmove(ctx->errorSpans + n, ctx->errorSpans, keep * sizeof(Span));
+        ctx->nErrors = keep;
+    }
+    memcpy(ctx->errors, lex->errors, n * MAX_ERROR_LEN);
+    memcpy(ctx->errorSpans, lex->errorSpans, n * sizeof(Span));
+    ctx->nErrors += n;
+    ctx->nLexErrors = n;
+    if(ctx->stats) {
+        for(i = 0; i <= CT_CHAR; i++) ctx->stats->tokens[i] += lexStats.tokens[i];
+        ctx->stats->allocs += lexStats.allocs;
+        ctx->stats->allocBytes += lexStats.allocBytes;
+        ctx->stats->lexTime += lexStats.lexTime;
+        ctx->stats->lexWait += pipe.lexWait;
+        ctx->stats->parseWait += pipe.parseWait;
+    }
+    freeContext(lex);
+    return res;
+}
+
+// Parallel lexing. A chunk starts after a '\n', and every '\n' starts a line whatever the
+// lexer state, so the line index is built (and the first line of each chunk known) before
+// any lexing. Each chunk then has a context of its own and lexes up to the first token
+// boundary at or after the start of the next chunk. When that boundary is the next
+// chunk's start, the next chunk guessed right; otherwise (a comment or string goes on
+// over the line break) it is lexed again from the boundary.
+typedef struct{
+    Context *lex;
+    char *start, *end;                  // end: start of the next chunk, or of the '\0'
+    int lines, firstLine;               // '\n' in start..end, and the line start is on
+    int res;
+    Stats stats;
+} Chunk;
+
+// Runs job on every chunk, chunk 0 on the calling thread; a thread that cannot be
+// started leaves its chunk to the calling thread as well.
+static void runChunks(Chunk *chunks, int n, void *(*job)(void*)) {
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS], i;
+    for(i = 1; i < n; i++) started[i] = pthread_create(&threads[i], NULL, job, &chunks[i]) == 0;
+    job(&chunks[0]);
+    for(i = 1; i < n; i++) {
+        if(started[i]) pthread_join(threads[i], NULL);
+        else job(&chunks[i]);
+    }
+}
+
+static void *countChunkLines(void *arg) {
+    Chunk *c = (Chunk*)arg;
+    const char *p = c->start;
+    while((p = (const char*)memchr(p, '\n', c->end - p)) != NULL) {
+        c->lines++;
+        p++;
+    }
+    return NULL;
+}
+
+static void *indexChunkLines(void *arg) {
+    Chunk *c = (Chunk*)arg;
+    const char *p = c->start;
+    int line = c->firstLine;
+    while((p = (const char*)memchr(p, '\n', c->end - p)) != NULL) {
+        p++;
+        c->lex->lineStarts[++line] = p - c->lex->text;
+    }
+    return NULL;
+}
+
+static void *lexChunk(void *arg) {
+    Chunk *c = (Chunk*)arg;
+    double start = c->lex->trace ? seconds() : 0;
+    c->res = lexFrom(c->lex, c->start);
+    TRACE(c->lex, "lex chunk", start);
+    return NULL;
+}
+
+int parallelTokens(Context *ctx, char *input, int nThreads) {
+    Chunk chunks[MAX_THREADS], *c;
+    double start = ctx->stats || ctx->trace ? seconds() : 0;
+    char *end = input + strlen(input), *p, *from;
+    int n = 0, lines = 0, res = RES_OK, relexed = 0, k, i;
+    Token *last = NULL;
+
+    if(nThreads > MAX_THREADS) nThreads = MAX_THREADS;
+    if(nThreads > (end - input) / LEX_CHUNK) nThreads = (end - input) / LEX_CHUNK;
+    if(nThreads < 2) return generateTokens(ctx, input);
+    memset(chunks, 0, sizeof(chunks));
+    // about equal chunks, each ending after a '\n'
+    for(k = 1, p = input; k <= nThreads && p < end; k++) {
+        chunks[n].start = p;
+        p = input + (end - input) / nThreads * k;
+        if(p < chunks[n].start) p = chunks[n].start;
+        if(k == nThreads || (p = (char*)memchr(p, '\n', end - p)) == NULL) p = end;
+        else p++;
+        chunks[n++].end = p;
+    }
+    if(n < 2) return generateTokens(ctx, input);
+
+    runChunks(chunks, n, countChunkLines);
+    for(k = 0; k < n; k++) {
+        chunks[k].firstLine = lines;
+        lines += chunks[k].lines;
+    }
+    free(ctx->lineStarts);
+    if((ctx->lineStarts = (int*)malloc((lines + 2) * sizeof(int))) == NULL) return RES_FATAL;
+    COUNT_ALLOC(ctx, (lines + 2) * sizeof(int));
+    ctx->maxLines = lines + 2;
+    ctx->lineStarts[0] = 0;
+    ctx->text = input;
+    for(k = 0; k < n; k++) {
+        c = &chunks[k];
+        if((c->lex = createContext()) == NULL) {
+            res = RES_FATAL;
+            break;
+        }
+        c->lex->text = input;
+        c->lex->lineStarts = ctx->lineStarts;
+        c->lex->maxLines = ctx->maxLines;
+        c->lex->linesKnown = 1;
+        c->lex->line = c->firstLine;
+        c->lex->lexEnd = k < n - 1 ? c->end : NULL;
+        if(ctx->stats) c->lex->stats = &c->stats;
+        c->lex->trace = ctx->trace;
+        c->lex->traceTid = ctx->traceTid + PIPE_TID + k;
+        c->lex->traceFile = ctx->traceFile;
+    }
+    if(res == RES_OK) {
+        runChunks(chunks, n, indexChunkLines);
+        runChunks(chunks, n, lexChunk);
+    }
+
+    // take the chunks in order, lexing again those that started in the wrong place
+    for(k = 0, from = input; res == RES_OK && k < n; k++) {
+        c = &chunks[k];
+        if(from == NULL) break;         // END came in an earlier chunk
+        if(c->start != from) {
+            freeTokens(c->lex->tokens, NULL);
+            c->lex->tokens = c->lex->lastToken = NULL;
+            c->lex->nErrors = 0;
+            memset(&c->stats, 0, sizeof(Stats));
+            c->lex->line = chunks[k - 1].lex->line;
+            c->lex->lexEnd = k < n - 1 ? c->end : NULL;
+            c->res = lexFrom(c->lex, from);
+            relexed++;
+        }
+        if(c->lex->tokens) {
+            if(last) last->next = c->lex->tokens;
+            else ctx->tokens = c->lex->tokens;
+            last = c->lex->lastToken;
+            c->lex->tokens = NULL;
+            takeStrings(ctx, &c->lex->strings);
+        }
+        i = c->lex->nErrors < MAX_ERRORS - ctx->nErrors ? c->lex->nErrors : MAX_ERRORS - ctx->nErrors;
+        memcpy(ctx->errors + ctx->nErrors, c->lex->errors, i * MAX_ERROR_LEN);
+        memcpy(ctx->errorSpans + ctx->nErrors, c->lex->errorSpans, i * sizeof(Span));
+        ctx->nErrors += i;
+        ctx->line = c->lex->line;
+        if(ctx->stats) {
+            for(i = 0; i <= CT_CHAR; i++) ctx->stats->tokens[i] += c->stats.tokens[i];
+            ctx->stats->allocs += c->stats.allocs;
+            ctx->stats->allocBytes += c->stats.allocBytes;
+        }
+        if(c->res != RES_OK && c->res != RES_ERRORS) res = c->res;
+        else if(ctx->nErrors == MAX_ERRORS) res = RES_TOO_MANY_ERRORS;
+        from = last && last->code == END ? NULL : c->lex->lexEnd;
+    }
+    ctx->lastToken = last;
+    ctx->nLexErrors = ctx->nErrors;
+    for(k = 0; k < n && chunks[k].lex; k++) {
+        chunks[k].lex->lineStarts = NULL;
+        freeContext(chunks[k].lex);
+    }
+    STAT(ctx, chunks += n);
+    STAT(ctx, chunksRelexed += relexed);
+    STAT(ctx, lexTime += seconds() - start);
+    TRACE(ctx, "lex", start);
+    if(res == RES_OK && ctx->nErrors) res = RES_ERRORS;
+    return res;
+}
+
+// The lexer proper: adds the tokens found from pCrtCh on. While relexing it stops
+// as soon as the new tokens line up with the old ones again (see relexEdit). When
+// streaming it stops after about LEX_BATCH bytes, at the start of a token.
+static int lexRun(Context *ctx, char *pCrtCh) {
+    int state = 0, startLine = ctx->line, code, overflow;
     char ch;
-    char *pStartCh, *pCrtCh = input;
-    Token *tk;
+    char *pStartCh = pCrtCh;
+    Token *tk, *last = ctx->lastToken;
     while(1) {
         ch = (*pCrtCh);
         switch(state) {
             case 0:
                 pStartCh = pCrtCh;
+                startLine = ctx->line;          // constants can span lines
+                if(ctx->relexOld && pCrtCh - ctx->text >= ctx->relexFrom && resynchronized(ctx, pCrtCh - ctx->text)) {
+                    ctx->nLexErrors = ctx->nErrors;
+                    return ctx->nErrors ? RES_ERRORS : RES_OK;
+                }
+                if(ctx->lexPos && ctx->lastToken != last && pCrtCh - ctx->lexPos >= LEX_BATCH) {
+                    ctx->lexPos = pCrtCh;
+                    return ctx->nErrors ? RES_ERRORS : RES_OK;
+                }
+                if(ctx->lexEnd && pCrtCh >= ctx->lexEnd && ch != '\0') {
+                    ctx->lexEnd = pCrtCh;
+                    ctx->nLexErrors = ctx->nErrors;
+                    return ctx->nErrors ? RES_ERRORS : RES_OK;
+                }
                 if (ch == '\n') {
-                    line++;
                     pCrtCh++;
+                    newLine(ctx, pCrtCh);
                 } else if(ch > '0' && ch <= '9') {
                     state = 1;
                     pCrtCh++;
@@ -226,102 +1197,105 @@ void generateTokens(char *input) {
                     state = 30;
                 } else if(ch == ',') {
                     pCrtCh++;
-                    addTk(COMMA);
+                    addTk(ctx, COMMA, pStartCh, pCrtCh);
                 } else if(ch == ';') {
                     pCrtCh++;
-                    addTk(SEMICOLON);
+                    addTk(ctx, SEMICOLON, pStartCh, pCrtCh);
                 } else if(ch == '(') {
                     pCrtCh++;
-                    addTk(LPAR);
+                    addTk(ctx, LPAR, pStartCh, pCrtCh);
                 } else if(ch == ')') {
                     pCrtCh++;
-                    addTk(RPAR);
+                    addTk(ctx, RPAR, pStartCh, pCrtCh);
                 } else if(ch == '[') {
                     pCrtCh++;
-                    addTk(LBRACKET);
+                    addTk(ctx, LBRACKET, pStartCh, pCrtCh);
                 } else if(ch == ']') {
                     pCrtCh++;
-                    addTk(RBRACKET);
+                    addTk(ctx, RBRACKET, pStartCh, pCrtCh);
                 } else if(ch == '{') {
                     pCrtCh++;
-                    addTk(LACC);
+                    addTk(ctx, LACC, pStartCh, pCrtCh);
                 } else if(ch == '}') {
                     pCrtCh++;
-                    addTk(RACC);
+                    addTk(ctx, RACC, pStartCh, pCrtCh);
                 } else if(ch == '+') {
                     pCrtCh++;
-                    addTk(ADD);
+                    addTk(ctx, ADD, pStartCh, pCrtCh);
                 } else if(ch == '-') {
                     pCrtCh++;
-                    addTk(SUB);
+                    addTk(ctx, SUB, pStartCh, pCrtCh);
                 } else if(ch == '*') {
                     pCrtCh++;
-                    addTk(MUL);
+                    addTk(ctx, MUL, pStartCh, pCrtCh);
                 } else if(ch == '.') {
                     pCrtCh++;
-                    addTk(DOT);
+                    addTk(ctx, DOT, pStartCh, pCrtCh);
                 } else if(ch == '&') {
                     pCrtCh++;
                     ch = *pCrtCh;
                     if(ch == '&') {
                         pCrtCh++;
-                        addTk(AND);
                     } else {
-                        tkerr(tk, "ERROR: Expected binary operator.\n");
+                        lexerr(ctx, pCrtCh, "expected && operator");
                     }
+                    addTk(ctx, AND, pStartCh, pCrtCh);
                 } else if(ch == '|') {
                     pCrtCh++;
                     ch = *pCrtCh;
                     if(ch == '|'){
                         pCrtCh++;
-                        addTk(OR);
                     }
                     else {
-                        tkerr(tk, "ERROR: Expected binary operator.\n");
+                        lexerr(ctx, pCrtCh, "expected || operator");
                     }
+                    addTk(ctx, OR, pStartCh, pCrtCh);
                 } else if(ch == '!') {
                     pCrtCh++;
                     ch = *pCrtCh;
                     if(ch == '=') {
                         pCrtCh++;
-                        addTk(NEQUAL);
+                        addTk(ctx, NEQUAL, pStartCh, pCrtCh);
                     } else {
-                        addTk(NOT);
+                        addTk(ctx, NOT, pStartCh, pCrtCh);
                     }
                 } else if(ch == '=') {
                     pCrtCh++;
                     ch = *pCrtCh;
                     if(ch == '=') {
                         pCrtCh++;
-                        addTk(EQUAL);
+                        addTk(ctx, EQUAL, pStartCh, pCrtCh);
                     } else {
-                        addTk(ASSIGN);
+                        addTk(ctx, ASSIGN, pStartCh, pCrtCh);
                     }
                 } else if(ch == '<') {
                     pCrtCh++;
                     ch = *pCrtCh;
                     if(ch == '=') {
                         pCrtCh++;
-                        addTk(LESSEQ);
+                        addTk(ctx, LESSEQ, pStartCh, pCrtCh);
                     }
                     else{
-                        addTk(LESS);
+                        addTk(ctx, LESS, pStartCh, pCrtCh);
                     }
                 } else if (ch == '>') {
                     pCrtCh++;
                     ch = *pCrtCh;
                     if(ch == '='){
                         pCrtCh++;
-                        addTk(GREATEREQ);
+                        addTk(ctx, GREATEREQ, pStartCh, pCrtCh);
                     }
                     else{
-                        addTk(GREATER);
+                        addTk(ctx, GREATER, pStartCh, pCrtCh);
                     }
                 } else if(ch == '\0') {
-                    addTk(END);
-                    return;
+                    addTk(ctx, END, pStartCh, pCrtCh);
+                    ctx->lexPos = NULL;
+                    ctx->nLexErrors = ctx->nErrors;
+                    return ctx->nErrors ? RES_ERRORS : RES_OK;
                 } else {
-                    tkerr(tk, "ERROR: Unrecognized character in state %i.", state);
+                    lexerr(ctx, pCrtCh, "unrecognized character '%c'", ch);
+                    pCrtCh++;
                 }
                 break;
             case 1:
@@ -371,7 +1345,8 @@ void generateTokens(char *input) {
                     state = 5;
                     pCrtCh++;
                 } else {
-                    tkerr(tk, "ERROR: Unrecognized character in state %i.", state);
+                    lexerr(ctx, pCrtCh, "hexadecimal digit expected");
+                    state = 6;
                 }
                 break;
             case 5:
@@ -382,8 +1357,9 @@ void generateTokens(char *input) {
                 }
                 break;
             case 6:
-                tk = addTk(CT_INT);
-                tk->i = strtol(pStartCh, NULL, 0);
+                tk = addTk(ctx, CT_INT, pStartCh, pCrtCh);
+                tk->i = intValue(pStartCh, pCrtCh, &overflow);
+                if(overflow) lexerr(ctx, pStartCh, "integer constant too large");
                 state = 0;
                 break;
             case 7:
@@ -391,7 +1367,8 @@ void generateTokens(char *input) {
                     pCrtCh++;
                     state = 8;
                 } else {
-                    tkerr(tk, "ERROR: Unrecognized character in state %i. Float expected.", state);
+                    lexerr(ctx, pCrtCh, "digit expected after decimal point");
+                    state = 13;
                 }
                 break;
             case 8:
@@ -417,7 +1394,6 @@ void generateTokens(char *input) {
                     pCrtCh++;
                     state = 12;
                 } else {
-                    pCrtCh++;
                     state = 11;
                 }
                 break;
@@ -426,7 +1402,8 @@ void generateTokens(char *input) {
                     pCrtCh++;
                     state = 12;
                 } else {
-                    tkerr(tk, "ERROR: Unrecognized character in state %i. Digit expected.", state);
+                    lexerr(ctx, pCrtCh, "digit expected in exponent");
+                    state = 13;
                 }
                 break;
             case 12:
@@ -437,8 +1414,9 @@ void generateTokens(char *input) {
                 }
                 break;
             case 13:
-                tk = addTk(CT_REAL);
-                tk->r = strtod(pStartCh, NULL);
+                tk = addTk(ctx, CT_REAL, pStartCh, pCrtCh);
+                tk->r = realValue(pStartCh, pCrtCh);
+                if(isinf(tk->r)) lexerr(ctx, pStartCh, "real constant too large");
                 state = 0;
                 break;
             case 49:
@@ -449,7 +1427,7 @@ void generateTokens(char *input) {
                     pCrtCh++;
                     state = 50;
                 } else {
-                    addTk(DIV);
+                    addTk(ctx, DIV, pStartCh, pCrtCh);
                     state = 0;
                 }
                 break;
@@ -457,8 +1435,12 @@ void generateTokens(char *input) {
                 if(ch == '*'){
                     pCrtCh++;
                     state = 53;
+                } else if(ch == '\0') {
+                    lexerr(ctx, pStartCh, "unterminated comment");
+                    state = 0;
                 } else {
                     pCrtCh++;
+                    if(ch == '\n') newLine(ctx, pCrtCh);
                 }
                 break;
             case 53:
@@ -467,8 +1449,12 @@ void generateTokens(char *input) {
                     state = 0;
                 } else if(ch == '*') {
                     pCrtCh++;
+                } else if(ch == '\0') {
+                    lexerr(ctx, pStartCh, "unterminated comment");
+                    state = 0;
                 } else {
                     pCrtCh++;
+                    if(ch == '\n') newLine(ctx, pCrtCh);
                     state = 52;
                 }
                 break;
@@ -478,63 +1464,19 @@ void generateTokens(char *input) {
                 } else if(ch == '\n') {
                     pCrtCh++;
                     state = 0;
-                    line++;
+                    newLine(ctx, pCrtCh);
                 } else {
-                    pCrtCh++;
+                    if(ch == '\r') pCrtCh++;
                     state = 0;
                 }
                 break;
             case 36:
                 if((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_') {
-                    if(!memcmp(pStartCh,"break", 5)) {
-                        tk = addTk(BREAK);
-                        pCrtCh += 3;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"char", 4)) {
-                        tk = addTk(CHAR);
-                        pCrtCh += 2;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"double", 6)) {
-                        tk = addTk(DOUBLE);
-                        pCrtCh += 4;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"else", 4)) {
-                        tk = addTk(ELSE);
-                        pCrtCh += 2;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"for", 3)) {
-                        tk = addTk(FOR);
-                        pCrtCh += 1;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"if", 2)) {
-                        tk = addTk(IF);
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"int", 3)) {
-                        tk = addTk(INT);
-                        pCrtCh += 2;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"return", 6)) {
-                        tk = addTk(RETURN);
-                        pCrtCh += 4;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"struct", 6)) {
-                        tk = addTk(STRUCT);
-                        pCrtCh += 4;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"void", 4)) {
-                        tk = addTk(VOID);
-                        pCrtCh += 2;
-                        state = 0;
-                    } else if(!memcmp(pStartCh,"while", 5)) {
-                        tk = addTk(WHILE);
-                        pCrtCh += 3;
-                        state = 0;
-                    }
                     pCrtCh++;
                 } else {
-                    tk = addTk(ID);
-                    char* str =  createString(pStartCh, pCrtCh);
-                    tk->text = str;
+                    code = keywordCode(pStartCh, pCrtCh - pStartCh);
+                    tk = addTk(ctx, code, pStartCh, pCrtCh);
+                    if(code == ID) tk->text = internString(ctx, pStartCh, pCrtCh, 0);
                     state = 0;
                 }
                 break;
@@ -542,33 +1484,37 @@ void generateTokens(char *input) {
                 if(ch == '\\') {
                     pCrtCh++;
                     state = 16;
+                } else if(ch == '\0') {
+                    state = 17;
                 } else {
                     pCrtCh++;
+                    if(ch == '\n') newLine(ctx, pCrtCh);
                     state = 17;
                 }
                 break;
             case 16:
-                if(strchr("abfnrtv'?\"\\0", ch)) {
+                if(ch == '\0') {
+                    state = 17;
+                } else if(strchr("abfnrtv'?\"\\0", ch)) {
                     pCrtCh++;
                     state = 17;
                 } else {
-                    tkerr(tk,"ERROR: Escape character expected\n");
+                    lexerr(ctx, pCrtCh, "invalid escape sequence '\\%c'", ch);
+                    pCrtCh++;
+                    if(ch == '\n') newLine(ctx, pCrtCh);
+                    state = 17;
                 }
                 break;
             case 17:
                 if(ch == '\'') {
-                    tk = addTk(CT_CHAR);
-                    char *str = createString(pStartCh + 1, pCrtCh), c;
-                    if(strchr(str, '\\') != NULL) {
-                        c = escapeCharacter(*(str + 1));
-                    } else {
-                        c = *str;
-                    }
-                    tk->i = c;
+                    tk = addTk(ctx, CT_CHAR, pStartCh, pCrtCh + 1);
+                    tk->line = startLine + 1;
+                    tk->i = pStartCh[1] == '\\' ? escapeCharacter(pStartCh[2]) : pStartCh[1];
                     pCrtCh++;
                     state = 0;
                 } else {
-                    tkerr(tk, "ERROR: Expected character\n");
+                    lexerr(ctx, pCrtCh, "missing ' at the end of character constant");
+                    state = 0;
                 }
                 break;
             case 30:
@@ -580,161 +1526,1487 @@ void generateTokens(char *input) {
                 }
                 break;
             case 32:
-                if(strchr("abfnrtv'?\"\\0", ch)) {
+                if(ch == '\0') {
+                    state = 33;
+                } else if(strchr("abfnrtv'?\"\\0", ch)) {
                     pCrtCh++;
                     state = 33;
                 } else {
-                    tkerr(tk, "ERROR: Escape sequence not recognized\n");
+                    lexerr(ctx, pCrtCh, "invalid escape sequence '\\%c'", ch);
+                    pCrtCh++;
+                    if(ch == '\n') newLine(ctx, pCrtCh);
+                    state = 33;
                 }
                 break;
             case 33:
                 if(ch == '\"') {
-                    tk = addTk(STRING);
-                    char *str = createString(pStartCh + 1, pCrtCh), *p;
-                    while((p = strchr(str, '\\')) != NULL) {
-                        memmove(p, p + 1, strlen(p));
-                        *p = escapeCharacter(*p);
-                    }
-                    tk->text = str;
+                    tk = addTk(ctx, STRING, pStartCh, pCrtCh + 1);
+                    tk->line = startLine + 1;
+                    tk->text = internString(ctx, pStartCh + 1, pCrtCh, 1);
                     pCrtCh++;
                     state = 0;
+                } else if(ch == '\0') {
+                    lexerr(ctx, pStartCh, "missing \" at the end of string");
+                    state = 0;
                 } else {
                     state = 30;
                     pCrtCh++;
+                    if(ch == '\n') newLine(ctx, pCrtCh);
                 }
                 break;
         }
     }
 }
 
+// Next old token that could line up with a new token starting at offset; true when one does.
+// An old lexical error at the start of that token may have been found by lexing the text
+// before it, which changed, so the lexer does not stop at such a token.
+static int resynchronized(Context *ctx, int offset) {
+    while(ctx->relexOld->offset + ctx->relexDelta < offset) ctx->relexOld = ctx->relexOld->next;
+    if(ctx->relexOld->offset + ctx->relexDelta != offset) return 0;
+    while(ctx->relexError < ctx->nRelexErrors && ctx->relexErrors[ctx->relexError].offset < ctx->relexOld->offset) ctx->relexError++;
+    return ctx->relexError == ctx->nRelexErrors || ctx->relexErrors[ctx->relexError].offset != ctx->relexOld->offset;
+}
+
+// Applies the offset/line shift left by the last relexEdit to the tokens it reused.
+void fixTokens(Context *ctx) {
+    Token *tk;
+    for(tk = ctx->fixFrom; tk != NULL; tk = tk->next) {
+        tk->offset += ctx->fixOffset;
+        tk->line += ctx->fixLine;
+    }
+    ctx->fixFrom = NULL;
+}
+
+// Narrows down what the next unit() has to parse again, now that the tokens from first
+// up to next (excluded) are replaced. An edit that stays inside the body of a function,
+// braces excluded, is the only one that does not need everything parsed again.
+static void markChanged(Context *ctx, Token *first, Token *next) {
+    int lo = 0, hi = ctx->nDecls - 1, mid, k;
+    Decl *d;
+    if(ctx->changed == CHANGED_ALL) return;
+    if(next == NULL || ctx->nDecls == 0) {
+        ctx->changed = CHANGED_ALL;
+        return;
+    }
+    // last declaration starting before first
+    while(lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if(ctx->decls[mid].first->offset < first->offset) lo = mid;
+        else hi = mid - 1;
+    }
+    d = &ctx->decls[lo];
+    if(d->func == NULL || d->body->offset >= first->offset || next->offset > d->end->offset
+            || (ctx->changed != CHANGED_NONE && ctx->changed != lo)) {
+        ctx->changed = CHANGED_ALL;
+        return;
+    }
+    ctx->changed = lo;
+    // the errors kept for the declarations after it have their line and column in the text
+    for(k = lo + 1; k < ctx->nDecls; k++) {
+        if(ctx->decls[k].nErrors && (ctx->line + 1 != next->line
+                || (ctx->relexDelta && ctx->decls[k].first->line == d->end->line))) ctx->changed = CHANGED_ALL;
+    }
+}
+
+// Replaces deleted bytes at offset with inserted and updates the token list.
+// Lexing restarts at a token that begins before the edit and stops as soon
+// as a new token starts where an old one, shifted by the edit, used to start: from
+// there on text and lexer state are the same as before, so the old tokens are kept.
+// Their offsets and lines are shifted later, by fixTokens. So are the lexical errors:
+// those before the restart point stay, those up to where the lexer resynchronized are
+// found again, and those after it are kept, with their line and column updated.
+int relexEdit(Context *ctx, int offset, int deleted, const char *inserted) {
+    int oldLen = strlen(ctx->text), insLen = strlen(inserted), oldLines = ctx->line;
+    int start = 0, res, restartLine, nTail, need, i, *tail = NULL, *lineStarts;
+    int nBefore, nAfter;
+    char (*after)[MAX_ERROR_LEN];
+    Span *afterSpans;
+    double time;
+    char *text;
+    Token *prev = NULL, *first, *tk, *last, *oldLast = ctx->lastToken;
+
+    if(ctx->streaming || ctx->cached) return RES_INVALID;
+    if(offset < 0 || deleted < 0 || offset + deleted > oldLen) return RES_INVALID;
+    if((text = (char*)malloc(oldLen - deleted + insLen + 1)) == NULL) return RES_FATAL;
+    COUNT_ALLOC(ctx, oldLen - deleted + insLen + 1);
+    memcpy(text, ctx->text, offset);
+    memcpy(text + offset, inserted, insLen);
+    strcpy(text + offset + insLen, ctx->text + offset + deleted);
+    if(ctx->ownsText) free(ctx->text);
+    ctx->text = text;
+    ctx->ownsText = 1;
+    fixTokens(ctx);
+
+    // a lexical error at the start of a token may come from the text before it, which
+    // would not be lexed again: lexing restarts at the last token before the edit with none
+    first = ctx->tokens;
+    ctx->line = 0;
+    for(tk = first, last = NULL, i = 0; tk->offset < offset; last = tk, tk = tk->next) {
+        while(i < ctx->nLexErrors && ctx->errorSpans[i].offset < tk->offset) i++;
+        if(i == ctx->nLexErrors || ctx->errorSpans[i].offset != tk->offset) {
+            prev = last;
+            first = tk;
+            start = first->offset;
+            ctx->line = first->line - 1;
+        }
+    }
+    // the lexer overwrites the starts of the lines after restartLine; those past
+    // the point where it resynchronizes are put back from tail
+    restartLine = ctx->line;
+    nTail = oldLines - restartLine;
+    if((tail = (int*)malloc(nTail * sizeof(int) + 1)) == NULL) return RES_FATAL;
+    memcpy(tail, ctx->lineStarts + restartLine + 1, nTail * sizeof(int));
+    for(nBefore = 0; nBefore < ctx->nLexErrors && ctx->errorSpans[nBefore].offset < start; nBefore++);
+    nAfter = ctx->nLexErrors - nBefore;
+    after = malloc(nAfter * MAX_ERROR_LEN + 1);
+    afterSpans = (Span*)malloc(nAfter * sizeof(Span) + 1);
+    if(after == NULL || afterSpans == NULL) {
+        free(tail);
+        free(after);
+        free(afterSpans);
+        return RES_FATAL;
+    }
+    COUNT_ALLOC(ctx, nTail * sizeof(int) + 1);
+    COUNT_ALLOC(ctx, nAfter * MAX_ERROR_LEN + 1);
+    COUNT_ALLOC(ctx, nAfter * sizeof(Span) + 1);
+    memcpy(after, ctx->errors + nBefore, nAfter * MAX_ERROR_LEN);
+    memcpy(afterSpans, ctx->errorSpans + nBefore, nAfter * sizeof(Span));
+    ctx->nErrors = nBefore;
+    for(tk = first; tk->offset < offset + deleted; tk = tk->next);
+    ctx->relexOld = tk;
+    ctx->relexErrors = afterSpans;
+    ctx->nRelexErrors = nAfter;
+    ctx->relexError = 0;
+    ctx->relexDelta = insLen - deleted;
+    ctx->relexFrom = offset + insLen;
+    ctx->lastToken = prev;          // new tokens go right after the last one kept
+
+    time = ctx->stats || ctx->trace ? seconds() : 0;
+    res = lexFrom(ctx, ctx->text + start);
+    STAT(ctx, lexTime += seconds() - time);
+    TRACE(ctx, "relex", time);
+    tk = ctx->relexOld;
+    ctx->relexOld = NULL;
+    ctx->relexErrors = NULL;
+    if(res != RES_OK && res != RES_ERRORS) tk = NULL;
+    else if(ctx->lastToken && ctx->lastToken->code == END) tk = NULL;
+    markChanged(ctx, first, tk);
+
+    freeTokens(first, tk);
+    if(tk) {
+        if(ctx->lastToken) ctx->lastToken->next = tk;
+        else ctx->tokens = tk;
+        ctx->lastToken = oldLast;
+        ctx->fixFrom = tk;
+        ctx->fixOffset = ctx->relexDelta;
+        ctx->fixLine = ctx->line + 1 - tk->line;
+        need = oldLines + ctx->fixLine + 1;
+        if(need > ctx->maxLines) {
+            if((lineStarts = (int*)realloc(ctx->lineStarts, need * 2 * sizeof(int))) == NULL) {
+                free(tail);
+                free(after);
+                free(afterSpans);
+                return RES_FATAL;
+            }
+            COUNT_ALLOC(ctx, need * 2 * sizeof(int));
+            ctx->lineStarts = lineStarts;
+            ctx->maxLines = need * 2;
+        }
+        for(i = tk->line - 1 - restartLine; i < nTail; i++) ctx->lineStarts[++ctx->line] = tail[i] + ctx->relexDelta;
+        // those before tk were found again; tk and the errors still have their old offsets
+        for(i = 0; i < nAfter && res != RES_TOO_MANY_ERRORS; i++) {
+            if(afterSpans[i].offset < tk->offset) continue;
+            memcpy(ctx->errors[ctx->nErrors], after[i], MAX_ERROR_LEN);
+            ctx->errorSpans[ctx->nErrors] = afterSpans[i];
+            moveError(ctx, ctx->nErrors, afterSpans[i].offset + ctx->relexDelta);
+            if(++ctx->nErrors == MAX_ERRORS) res = RES_TOO_MANY_ERRORS;
+        }
+        ctx->nLexErrors = ctx->nErrors;
+        if(res == RES_OK && ctx->nErrors) res = RES_ERRORS;
+    }
+    free(tail);
+    free(after);
+    free(afterSpans);
+    return res;
+}
+
+
+// Domain Analysis
+
+// FNV-1a; h is unsigned so wrap-around is well defined
+static unsigned hashName(const char *name) {
+    unsigned h = 2166136261u;
+    while(*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void initSymbols(Symbols *symbols) {
+    symbols->begin = NULL;
+    symbols->end = NULL;
+    symbols->after = NULL;
+}
+
+static Symbol *addSymbol(Context *ctx, Symbols *symbols, const char *name, int cls) {
+    Symbol *s;
+    if(symbols->end == symbols->after) {
+        int count = symbols->after - symbols->begin;
+        int n = count * 2;
+        if(n == 0) n = 1;
+        symbols->begin = (Symbol**)realloc(symbols->begin, n * sizeof(Symbol*));
+        if(symbols->begin == NULL) err(ctx, "not enough memory");
+        COUNT_ALLOC(ctx, n * sizeof(Symbol*));
+        symbols->end = symbols->begin + count;
+        symbols->after = symbols->begin + n;
+    }
+    SAFEALLOC(s,Symbol);
+    memset(s, 0, sizeof(Symbol));
+    *symbols->end++ = s;
+    if((s->name = strdup(name)) == NULL) err(ctx, "not enough memory");
+    COUNT_ALLOC(ctx, strlen(name) + 1);
+    s->hash = hashName(name);
+    s->cls = cls;
+    s->depth = ctx->crtDepth;
+    return s;
+}
+
+// searches from the end, so the innermost declaration wins
+static Symbol *findSymbol(Symbols *symbols, const char *name) {
+    Symbol **p = symbols->end;
+    unsigned h = hashName(name);
+    while(p != symbols->begin) {
+        p--;
+        if((*p)->hash == h && !strcmp((*p)->name, name)) return *p;
+    }
+    return NULL;
+}
+
+// ctx->symbols, then the ones declared before the body a parallelUnit worker is parsing
+static Symbol *lookup(Context *ctx, const char *name) {
+    Symbol *s = findSymbol(&ctx->symbols, name);
+    if(s == NULL && ctx->outer.end != ctx->outer.begin) s = findSymbol(&ctx->outer, name);
+    return s;
+}
+
+static void deleteSymbolsAfter(Symbols *symbols, Symbol *start) {
+    Symbol **p = symbols->begin;
+    if(start) {
+        while(p < symbols->end && *p != start) p++;
+        if(p < symbols->end) p++;
+    }
+    while(symbols->end > p) {
+        freeSymbol(*--symbols->end);
+    }
+}
+
+static void addVar(Context *ctx, Token *tkName, Type *t) {
+    Symbol *s;
+    if(ctx->crtStruct) {
+        if(findSymbol(&ctx->crtStruct->members, tkName->text))
+            tkerr(ctx, tkName, "symbol redefinition: %s", tkName->text);
+        if(t->typeBase == TB_STRUCT && t->s == ctx->crtStruct)
+            tkerr(ctx, tkName, "struct %s cannot contain itself", ctx->crtStruct->name);
+        if(t->nElements == 0)
+            tkerr(ctx, tkName, "array %s needs a constant size inside a struct", tkName->text);
+        if(typeSize(t) < 0) tkerr(ctx, tkName, "array %s too large", tkName->text);
+        s = addSymbol(ctx, &ctx->crtStruct->members, tkName->text, CLS_VAR);
+    } else {
+        s = lookup(ctx, tkName->text);
+        if(s && s->depth == ctx->crtDepth) tkerr(ctx, tkName, "symbol redefinition: %s", tkName->text);
+        s = addSymbol(ctx, &ctx->symbols, tkName->text, CLS_VAR);
+        s->mem = ctx->crtFunc ? MEM_LOCAL : MEM_GLOBAL;
+        if(typeSize(t) < 0) tkerr(ctx, tkName, "array %s too large", tkName->text);
+        if(ctx->crtFunc) {
+            if(t->nElements == 0) tkerr(ctx, tkName, "local array %s needs a constant size", tkName->text);
+            if((s->offset = frameSlot(ctx, t, MEM_LOCAL)) < 0) tkerr(ctx, tkName, "frame of %s too large", ctx->crtFunc->name);
+        }
+    }
+    s->type = *t;
+}
+
+static int typeAlign(Type *t) {
+    switch(t->typeBase) {
+        case TB_INT: return sizeof(int);
+        case TB_DOUBLE: return sizeof(double);
+        case TB_CHAR: return sizeof(char);
+        case TB_STRUCT: return t->s->align;
+    }
+    return 1;
+}
+
+// size in bytes of a value of type t; arrays count all their elements
+// -1 when that does not fit in an int
+static int typeSize(Type *t) {
+    long long size;
+    switch(t->typeBase) {
+        case TB_INT: size = sizeof(int); break;
+        case TB_DOUBLE: size = sizeof(double); break;
+        case TB_CHAR: size = sizeof(char); break;
+        case TB_STRUCT: size = t->s->size; break;
+        default: size = 0;
+    }
+    if(t->nElements > 0) size *= t->nElements;
+    return size <= INT_MAX ? (int)size : -1;
+}
+
+// Lays out the members in declaration order with natural alignment and
+// builds the name index used by findMember. Called once, when the struct
+// declaration is complete. Returns 0, and leaves the size 0, when the struct
+// does not fit in INT_MAX bytes.
+static int computeStructLayout(Context *ctx, Symbol *s) {
+    Symbol **p;
+    long long offset = 0;
+    int align = 1, n, fits = 1;
+    unsigned h;
+    for(p = s->members.begin; p != s->members.end; p++) {
+        int a = typeAlign(&(*p)->type), size = typeSize(&(*p)->type);
+        offset = (offset + a - 1) / a * a;
+        if(size < 0 || offset + size > INT_MAX) {
+            fits = 0;
+            offset = 0;
+        }
+        (*p)->offset = (int)offset;
+        offset += size < 0 ? 0 : size;
+        if(a > align) align = a;
+    }
+    s->align = align;
+    offset = (offset + align - 1) / align * align;
+    if(offset > INT_MAX) fits = 0;
+    s->size = fits ? (int)offset : 0;
+
+    n = s->members.end - s->members.begin;
+    for(s->indexSize = 1; s->indexSize < 2 * n; s->indexSize *= 2);
+    if((s->index = (Symbol**)calloc(s->indexSize, sizeof(Symbol*))) == NULL) err(ctx, "not enough memory");
+    COUNT_ALLOC(ctx, s->indexSize * sizeof(Symbol*));
+    for(p = s->members.begin; p != s->members.end; p++) {
+        for(h = (*p)->hash; s->index[h & (s->indexSize - 1)]; h++);
+        s->index[h & (s->indexSize - 1)] = *p;
+    }
+    return fits;
+}
+
+// Frames. The arguments of a function come first, in order, then its locals: each block
+// puts its own after those of the blocks around it, and when it ends the next block
+// reuses their bytes. An array argument is passed as a pointer.
+static int slotSize(Type *t, int mem) {
+    return mem == MEM_ARG && t->nElements >= 0 ? (int)sizeof(void*) : typeSize(t);
+}
+
+static int slotAlign(Type *t, int mem) {
+    return mem == MEM_ARG && t->nElements >= 0 ? (int)sizeof(void*) : typeAlign(t);
+}
+
+// Empties the frame of ctx->crtFunc, before its arguments are laid out.
+static void startFrame(Context *ctx) {
+    ctx->frameTop = 0;
+    ctx->crtFunc->size = 0;
+    ctx->crtFunc->align = 1;
+}
+
+// The offset of a new argument or local in the frame of ctx->crtFunc, which grows to hold it;
+// -1, and the frame is left as it was, when that would make it larger than MAX_FRAME.
+static int frameSlot(Context *ctx, Type *t, int mem) {
+    Symbol *f = ctx->crtFunc;
+    int align = slotAlign(t, mem), size = slotSize(t, mem), offset = (ctx->frameTop + align - 1) / align * align;
+    if(size < 0 || offset > MAX_FRAME - size) return -1;
+    ctx->frameTop = offset + size;
+    if(ctx->frameTop > f->size) f->size = ctx->frameTop;
+    if(align > f->align) f->align = align;
+    return offset;
+}
+
+// Pads the frame to its alignment once the body is parsed, so frames can be stacked.
+static void endFrame(Symbol *func) {
+    func->size = (func->size + func->align - 1) / func->align * func->align;
+}
+
+// bytes of the frame the arguments take
+static int frameArgs(Symbol *func) {
+    Symbol **p;
+    int end = 0, argEnd;
+    for(p = func->args.begin; p != func->args.end; p++) {
+        argEnd = (*p)->offset + slotSize(&(*p)->type, MEM_ARG);
+        if(argEnd > end) end = argEnd;
+    }
+    return end;
+}
+
+static Symbol *findMember(Symbol *s, const char *name) {
+    unsigned h;
+    Symbol *m;
+    for(h = hashName(name); (m = s->index[h & (s->indexSize - 1)]) != NULL; h++) {
+        if(!strcmp(m->name, name)) return m;
+    }
+    return NULL;
+}
+
+
+// Imports
+
+// import "file"; brings in the structs and functions another file declares, those it
+// imports included. They come from its interface file, the file name followed by
+// INTERFACE_SUFFIX, which holds them in binary form, all numbers little endian:
+//     "AINT", INTERFACE_VERSION (u32), hashBytes of the source (u64)
+//     number of files it depends on (u32), then for each: path (string), hash (u64)
+//     number of symbols (u32), then for each: cls (u32), name (string), type and
+//         CLS_STRUCT: number of members (u32), then for each: name (string), type
+//         CLS_FUNC, CLS_EXTFUNC: number of arguments (u32), then for each: name (string), type
+// A string is its byte count (u32) and its bytes followed by a NUL. A type is typeBase (u32),
+// nElements (u32, two's complement) and, for TB_STRUCT, the index of the struct among the
+// symbols before it (u32). The file is mapped and used as long as the source and every file
+// it depends on hash as recorded; otherwise the source is compiled and the file written again.
+
+char *readFile(const char *path, long *size) {
+    FILE *file;
+    char *text;
+    if((file = fopen(path, "rb")) == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(*size < 0 || (text = (char*)malloc(*size + 1)) == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    *size = fread(text, 1, *size, file);
+    text[*size] = '\0';
+    fclose(file);
+    return text;
+}
+
+unsigned long long hashBytes(const char *p, long n) {
+    unsigned long long h = 14695981039346656037ULL;
+    while(n-- > 0) {
+        h ^= (unsigned char)*p++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+typedef struct{
+    const unsigned char *p, *end;
+    int bad;                        // set once a read went past end or found nonsense
+} Reader;
+
+static unsigned rdU32(Reader *r) {
+    unsigned v = 0;
+    int i;
+    if(r->end - r->p < 4) {
+        r->bad = 1;
+        return 0;
+    }
+    for(i = 0; i < 4; i++) v |= (unsigned)r->p[i] << (8 * i);
+    r->p += 4;
+    return v;
+}
+
+static unsigned long long rdU64(Reader *r) {
+    unsigned long long v = rdU32(r);
+    return v | (unsigned long long)rdU32(r) << 32;
+}
+
+// NULL (and r->bad set) when there is no well formed string at r->p
+static const char *rdName(Reader *r) {
+    unsigned long n = rdU32(r);
+    const char *s = (const char*)r->p;
+    if(r->bad || (unsigned long)(r->end - r->p) < n + 1 || s[n] != '\0' || strlen(s) != n) {
+        r->bad = 1;
+        return NULL;
+    }
+    r->p += n + 1;
+    return s;
+}
+
+// A type whose struct, if any, is one of loaded[0..n).
+static void rdType(Reader *r, Type *t, Symbol **loaded, unsigned n) {
+    unsigned i;
+    t->typeBase = rdU32(r);
+    t->nElements = (int)rdU32(r);
+    t->s = NULL;
+    if(t->typeBase > TB_VOID) r->bad = 1;
+    else if(t->typeBase == TB_STRUCT) {
+        if((i = rdU32(r)) >= n || loaded[i]->cls != CLS_STRUCT) r->bad = 1;
+        else t->s = loaded[i];
+    }
+}
+
+static void wrName(Writer *w, const char *s) {
+    int n = strlen(s);
+    wrU32(w, n);
+    wrBytes(w, s, n + 1);
+}
+
+// The symbols an interface exports: everything at top level but the variables.
+static void wrType(Writer *w, Type *t, Symbol **begin, Symbol **end) {
+    unsigned i = 0;
+    wrU32(w, t->typeBase);
+    wrU32(w, (unsigned)t->nElements);
+    if(t->typeBase != TB_STRUCT) return;
+    for(; begin != end && *begin != t->s; begin++) {
+        if((*begin)->cls != CLS_VAR) i++;
+    }
+    wrU32(w, i);
+}
+
+// Writes the interface of the file ctx has just compiled, whose source hashed to hash.
+static void writeInterface(Context *ctx, FILE *out, unsigned long long hash) {
+    Writer w;
+    Symbol **p, **q;
+    int n = 0, i;
+    w.out = out;
+    w.n = 0;
+    wrStr(&w, "AINT");
+    wrU32(&w, INTERFACE_VERSION);
+    wrU64(&w, hash);
+    wrU32(&w, ctx->nImports);
+    for(i = 0; i < ctx->nImports; i++) {
+        wrName(&w, ctx->imports[i].path);
+        wrU64(&w, ctx->imports[i].hash);
+    }
+    for(p = ctx->symbols.begin; p != ctx->symbols.end; p++) {
+        if((*p)->cls != CLS_VAR) n++;
+    }
+    wrU32(&w, n);
+    for(p = ctx->symbols.begin; p != ctx->symbols.end; p++) {
+        if((*p)->cls == CLS_VAR) continue;
+        wrU32(&w, (*p)->cls);
+        wrName(&w, (*p)->name);
+        wrType(&w, &(*p)->type, ctx->symbols.begin, p);
+        // members and args share their storage
+        wrU32(&w, (*p)->members.end - (*p)->members.begin);
+        for(q = (*p)->members.begin; q != (*p)->members.end; q++) {
+            wrName(&w, (*q)->name);
+            wrType(&w, &(*q)->type, ctx->symbols.begin, p);
+        }
+    }
+    wrFlush(&w);
+}
+
+static int sameType(Type *a, Type *b) {
+    return a->typeBase == b->typeBase && a->nElements == b->nElements && a->s == b->s;
+}
+
+// Whether two imports of a symbol declare the same thing, as when two files import a third.
+static int sameDeclaration(Symbol *a, Symbol *b) {
+    Symbol **p, **q;
+    if(a->cls != b->cls || !sameType(&a->type, &b->type)) return 0;
+    if(a->members.end - a->members.begin != b->members.end - b->members.begin) return 0;
+    for(p = a->members.begin, q = b->members.begin; p != a->members.end; p++, q++) {
+        if(strcmp((*p)->name, (*q)->name) || !sameType(&(*p)->type, &(*q)->type)) return 0;
+    }
+    return 1;
+}
+
+// Adds the symbols of the interface at r to ctx. Returns 1 when they were added, 0 when r
+// is not a well formed interface of a source with that hash and unchanged dependencies,
+// and -1, with the name in clash, when a symbol clashes with one ctx already has. Unless
+// it returns 1, ctx is left as it was.
+static int loadInterface(Context *ctx, Reader *r, unsigned long long hash, char *clash, int clashSize) {
+    Reader deps;
+    Symbol **loaded = NULL, *s, *old, *m;
+    Type t;
+    const char *name;
+    unsigned long long h, now;
+    unsigned n, i, k, cls, mark = ctx->symbols.end - ctx->symbols.begin;
+    int res = 1;
+    if(r->end - r->p < 4 || memcmp(r->p, "AINT", 4)) return 0;
+    r->p += 4;
+    if(rdU32(r) != INTERFACE_VERSION || rdU64(r) != hash) return 0;
+    deps = *r;
+    for(n = rdU32(r), i = 0; i < n && !r->bad; i++) {
+        name = rdName(r);
+        h = rdU64(r);
+        if(!r->bad && (!hashFile(name, &now) || now != h)) return 0;
+    }
+    // each symbol takes at least 21 bytes, each member or argument 13
+    n = rdU32(r);
+    if(r->bad || n > (r->end - r->p) / 21 || (loaded = (Symbol**)malloc(n * sizeof(Symbol*) + 1)) == NULL) return 0;
+    COUNT_ALLOC(ctx, n * sizeof(Symbol*) + 1);
+    for(i = 0; i < n && res == 1; i++) {
+        cls = rdU32(r);
+        name = rdName(r);
+        rdType(r, &t, loaded, i);
+        k = rdU32(r);
+        if(r->bad || (cls != CLS_STRUCT && cls != CLS_FUNC && cls != CLS_EXTFUNC) || k > (r->end - r->p) / 13) {
+            res = 0;
+            break;
+        }
+        old = lookup(ctx, name);
+        s = addSymbol(ctx, &ctx->symbols, name, cls);
+        s->type = t;
+        s->imported = 1;
+        initSymbols(&s->members);
+        for(; k > 0; k--) {
+            if((name = rdName(r)) == NULL) break;
+            rdType(r, &t, loaded, i);
+            m = addSymbol(ctx, &s->members, name, CLS_VAR);
+            m->type = t;
+            if(cls != CLS_STRUCT) {
+                m->mem = MEM_ARG;
+                m->depth = 1;
+            }
+        }
+        if(r->bad) res = 0;
+        else if(cls == CLS_STRUCT && !computeStructLayout(ctx, s)) res = 0;
+        if(res == 1 && old) {
+            if(old->imported && sameDeclaration(old, s)) {
+                freeSymbol(*--ctx->symbols.end);
+                s = old;
+            } else {
+                snprintf(clash, clashSize, "%s", s->name);
+                res = -1;
+            }
+        }
+        loaded[i] = s;
+    }
+    free(loaded);
+    if(res != 1) {
+        while(ctx->symbols.end - ctx->symbols.begin > mark) freeSymbol(*--ctx->symbols.end);
+        return res;
+    }
+    for(n = rdU32(&deps), i = 0; i < n; i++) {
+        name = rdName(&deps);
+        addImport(ctx, name, rdU64(&deps));
+    }
+    return 1;
+}
+
+// Maps the interface file fd and loads it, as loadInterface.
+static int mapInterface(Context *ctx, int fd, unsigned long long hash, char *clash, int clashSize) {
+    struct stat st;
+    void *data;
+    Reader r;
+    int res;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) return 0;
+    if((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) return 0;
+    r.p = (const unsigned char*)data;
+    r.end = r.p + st.st_size;
+    r.bad = 0;
+    res = loadInterface(ctx, &r, hash, clash, clashSize);
+    munmap(data, st.st_size);
+    return res;
+}
+
+static void addImport(Context *ctx, const char *path, unsigned long long hash) {
+    Import *imports;
+    int i;
+    for(i = 0; i < ctx->nImports; i++) {
+        if(!strcmp(ctx->imports[i].path, path)) return;
+    }
+    if(ctx->nImports == ctx->maxImports) {
+        int max = ctx->maxImports ? ctx->maxImports * 2 : 8;
+        if((imports = (Import*)realloc(ctx->imports, max * sizeof(Import))) == NULL) err(ctx, "not enough memory");
+        COUNT_ALLOC(ctx, max * sizeof(Import));
+        ctx->imports = imports;
+        ctx->maxImports = max;
+    }
+    if((ctx->imports[ctx->nImports].path = strdup(path)) == NULL) err(ctx, "not enough memory");
+    COUNT_ALLOC(ctx, strlen(path) + 1);
+    ctx->imports[ctx->nImports++].hash = hash;
+}
+
+static void freeImports(Context *ctx) {
+    int i;
+    for(i = 0; i < ctx->nImports; i++) free(ctx->imports[i].path);
+    ctx->nImports = 0;
+}
+
+static int hashFile(const char *path, unsigned long long *hash) {
+    long size;
+    char *text = readFile(path, &size);
+    if(text == NULL) return 0;
+    *hash = hashBytes(text, size);
+    free(text);
+    return 1;
+}
+
+// Compiles the imported file into a context of its own and writes its interface next to it,
+// or to a temporary file when that cannot be created, then loads it into ctx. Takes text.
+// Returns as loadInterface.
+static int compileImport(Context *ctx, Token *tk, const char *path, char *text, unsigned long long hash, char *clash, int clashSize) {
+    Context *imp;
+    char name[PATH_MAX + 16], tmp[PATH_MAX + 32], first[MAX_ERROR_LEN];
+    FILE *out;
+    int res, fd, i;
+    if((imp = createContext()) == NULL) {
+        free(text);
+        err(ctx, "not enough memory");
+    }
+    imp->text = text;
+    imp->ownsText = 1;
+    imp->path = path;
+    imp->importer = ctx;
+    imp->trace = ctx->trace;
+    imp->traceTid = ctx->traceTid;
+    imp->traceFile = path;
+    res = generateTokens(imp, text);
+    if(res == RES_OK || res == RES_ERRORS) res = unit(imp);
+    if(res != RES_OK) {
+        snprintf(first, sizeof(first), "%s", imp->nErrors ? imp->errors[0] : "cannot compile it\n");
+        first[strcspn(first, "\n")] = '\0';
+        // fixing any of them may fix the import
+        for(i = 0; i < imp->nImports; i++) addImport(ctx, imp->imports[i].path, imp->imports[i].hash);
+        freeContext(imp);
+        tkerr(ctx, tk, "in imported file %s: %s", tk->text, first);
+    }
+    if((out = createInterface(path, tmp, &fd)) == NULL) {
+        freeContext(imp);
+        err(ctx, "cannot write the interface of %s", path);
+    }
+    writeInterface(imp, out, hash);
+    freeContext(imp);
+    res = fflush(out) == 0 ? mapInterface(ctx, fileno(out), hash, clash, clashSize) : 0;
+    // written under another name first: other compilations may be reading or writing it
+    snprintf(name, sizeof(name), "%s" INTERFACE_SUFFIX, path);
+    if(fd >= 0 && (res == 0 || rename(tmp, name) != 0)) unlink(tmp);
+    fclose(out);
+    return res;
+}
+
+// A new file for the interface of path: named tmp, to be renamed to the interface file once
+// written, and with its descriptor in *fd; or, when that cannot be created, a temporary file
+// with no name and *fd -1. NULL when neither can be created.
+static FILE *createInterface(const char *path, char *tmp, int *fd) {
+    struct stat st;
+    FILE *out;
+    snprintf(tmp, PATH_MAX + 32, "%s" INTERFACE_SUFFIX ".XXXXXX", path);
+    if((*fd = mkstemp(tmp)) < 0) return tmpfile();
+    // readable by whoever can read the source; mkstemp leaves it to the owner
+    if(stat(path, &st) == 0) fchmod(*fd, st.st_mode & 0666);
+    if((out = fdopen(*fd, "w+b")) == NULL) {
+        close(*fd);
+        unlink(tmp);
+    }
+    return out;
+}
+
+// Adds the declarations of the file an import names, relative to the importing file.
+static void importFile(Context *ctx, Token *tk) {
+    char name[PATH_MAX + 16], path[PATH_MAX], other[PATH_MAX], clash[128];
+    const char *slash = ctx->path && tk->text[0] != '/' ? strrchr(ctx->path, '/') : NULL;
+    Context *c;
+    char *text;
+    long size;
+    unsigned long long hash;
+    int res = 0, fd;
+
+    snprintf(name, sizeof(name), "%.*s%s", slash ? (int)(slash - ctx->path + 1) : 0, slash ? ctx->path : "", tk->text);
+    if(realpath(name, path) == NULL || (text = readFile(path, &size)) == NULL) {
+        addImport(ctx, name, 0);        // whoever caches the result must look again
+        tkerr(ctx, tk, "cannot read imported file %s", tk->text);
+    }
+    hash = hashBytes(text, size);
+    addImport(ctx, path, hash);
+    for(c = ctx; c != NULL; c = c->importer) {
+        if(c->path && realpath(c->path, other) && !strcmp(path, other)) {
+            free(text);
+            tkerr(ctx, tk, "import cycle: %s imports itself", tk->text);
+        }
+    }
+    snprintf(name, sizeof(name), "%s" INTERFACE_SUFFIX, path);
+    if((fd = open(name, O_RDONLY)) >= 0) {
+        res = mapInterface(ctx, fd, hash, clash, sizeof(clash));
+        close(fd);
+    }
+    if(res == 0) {
+        res = compileImport(ctx, tk, path, text, hash, clash, sizeof(clash));
+        STAT(ctx, importsCompiled++);
+    } else free(text);
+    if(res == 0) tkerr(ctx, tk, "cannot load the interface of %s", tk->text);
+    if(res < 0) tkerr(ctx, tk, "symbol redefinition: %s, imported from %s", clash, tk->text);
+    STAT(ctx, imports++);
+}
+
+// cachedUnit: loads the interface file fd when it is current; 1 when it did.
+static int loadCache(Context *ctx, int fd, unsigned long long hash) {
+    char clash[128];
+    if(setjmp(ctx->fatal)) return 0;
+    return mapInterface(ctx, fd, hash, clash, sizeof(clash)) == 1;
+}
+
+int cachedUnit(Context *ctx, char *input) {
+    char name[PATH_MAX + 16], tmp[PATH_MAX + 32];
+    unsigned long long hash = hashBytes(input, strlen(input));
+    double start = ctx->stats || ctx->trace ? seconds() : 0;
+    FILE *out;
+    int res, fd, named = ctx->path && strlen(ctx->path) < PATH_MAX;
+    if(named) {
+        snprintf(name, sizeof(name), "%s" INTERFACE_SUFFIX, ctx->path);
+        if((fd = open(name, O_RDONLY)) >= 0) {
+            res = loadCache(ctx, fd, hash);
+            close(fd);
+            if(res) {
+                ctx->text = input;
+                ctx->cached = 1;
+                TRACE(ctx, "cached", start);
+                return RES_OK;
+            }
+        }
+    }
+    res = generateTokens(ctx, input);
+    if(res == RES_OK || res == RES_ERRORS) res = unit(ctx);
+    // best effort: the next run just compiles the file again
+    if(res != RES_OK || !named || (out = createInterface(ctx->path, tmp, &fd)) == NULL) return res;
+    writeInterface(ctx, out, hash);
+    if(fd >= 0 && (fflush(out) != 0 || rename(tmp, name) != 0)) unlink(tmp);
+    fclose(out);
+    return res;
+}
+
 
 // Syntactic Analysis
 
-int consume(int code) {
-    if(currentToken->code == code) {
-        consumedTk = currentToken;
-        currentToken = currentToken->next;
+static int consume(Context *ctx, int code) {
+    if(ctx->currentToken->code == code) {
+        ctx->consumedTk = ctx->currentToken;
+        ctx->currentToken = nextTk(ctx, ctx->currentToken);
         return 1;
     }
     return 0;
 }
 
-// unit: ( declStruct | declFunc | declVar )* END
-int unit() {
-    currentToken = tokens;
+// Panic mode: skips tokens up to and including a SEMICOLON, or up to a RACC that closes
+// the enclosing block. A block opened while skipping is skipped whole. At top level the
+// skip also stops before a token that can start a declaration.
+static void resync(Context *ctx, int atTop) {
+    int nest = 0, skipped = 0;
+    while(ctx->currentToken->code != END) {
+        switch(ctx->currentToken->code) {
+            case STRUCT: case INT: case DOUBLE: case CHAR: case VOID:
+                if(atTop && nest == 0 && skipped) return;
+                break;
+            case SEMICOLON:
+                if(nest == 0) {
+                    consume(ctx, SEMICOLON);
+                    return;
+                }
+                break;
+            case LACC:
+                nest++;
+                break;
+            case RACC:
+                if(nest == 0 && !atTop) return;
+                if(nest == 0 || --nest == 0) {
+                    consume(ctx, RACC);
+                    consume(ctx, SEMICOLON);
+                    return;
+                }
+                break;
+        }
+        ctx->currentToken = nextTk(ctx, ctx->currentToken);
+        skipped = 1;
+    }
+}
+
+// Records the declaration unit() just went through; func is set when it was a complete function.
+static void endDecl(Context *ctx, Symbol *func) {
+    Decl *d, *decls;
+    int n = ctx->nErrors - ctx->declErrors;
+    if(ctx->streaming) {
+        if(func) TRACE(ctx, func->name, ctx->declStart);
+        dropTokens(ctx);
+        return;
+    }
+    if(ctx->nDecls == ctx->maxDecls) {
+        int max = ctx->maxDecls ? ctx->maxDecls * 2 : 16;
+        if((decls = (Decl*)realloc(ctx->decls, max * sizeof(Decl))) == NULL) err(ctx, "not enough memory");
+        COUNT_ALLOC(ctx, max * sizeof(Decl));
+        ctx->decls = decls;
+        ctx->maxDecls = max;
+    }
+    d = &ctx->decls[ctx->nDecls++];
+    d->first = ctx->declFirst;
+    d->func = func;
+    d->body = d->end = NULL;
+    if(func) {
+        if(!ctx->skipBodies) TRACE(ctx, func->name, ctx->declStart);
+        for(d->body = d->first; d->body->code != LACC; d->body = d->body->next);
+        d->end = ctx->consumedTk;
+    }
+    d->symbolsEnd = ctx->symbols.end - ctx->symbols.begin;
+    d->errors = NULL;
+    d->spans = NULL;
+    d->nErrors = 0;
+    saveErrors(ctx, d, ctx->declErrors, n);
+}
+
+// Streaming: frees the tokens of the declarations parsed so far. No rule goes back
+// past the start of a declaration, and symbols keep their own copies of the names.
+static void dropTokens(Context *ctx) {
+    freeTokens(ctx->tokens, ctx->currentToken);
+    ctx->tokens = ctx->currentToken;
+    ctx->unaryFrom = NULL;
+}
+
+// Copies n errors, starting with errors[from], into d.
+static void saveErrors(Context *ctx, Decl *d, int from, int n) {
+    int i;
+    free(d->errors);
+    free(d->spans);
+    d->errors = NULL;
+    d->spans = NULL;
+    d->nErrors = n;
+    if(n == 0) return;
+    if((d->errors = malloc(n * MAX_ERROR_LEN)) == NULL || (d->spans = (Span*)malloc(n * sizeof(Span))) == NULL) {
+        d->nErrors = 0;
+        err(ctx, "not enough memory");
+    }
+    COUNT_ALLOC(ctx, n * MAX_ERROR_LEN);
+    COUNT_ALLOC(ctx, n * sizeof(Span));
+    memcpy(d->errors, ctx->errors + from, n * MAX_ERROR_LEN);
+    for(i = 0; i < n; i++) {
+        d->spans[i] = ctx->errorSpans[from + i];
+        if(d->spans[i].offset >= 0) d->spans[i].offset -= d->first->offset;
+    }
+}
+
+static void freeDecls(Context *ctx) {
+    int i;
+    for(i = 0; i < ctx->nDecls; i++) {
+        free(ctx->decls[i].errors);
+        free(ctx->decls[i].spans);
+    }
+    ctx->nDecls = 0;
+}
+
+// Adds the errors of a declaration that is not parsed again, as if they were found now.
+static void keepErrors(Context *ctx, Decl *d) {
+    int n = d->nErrors, i;
+    Span *span;
+    if(n == 0) return;
+    if(n > MAX_ERRORS - ctx->nErrors) n = MAX_ERRORS - ctx->nErrors;
+    memcpy(ctx->errors + ctx->nErrors, d->errors, n * MAX_ERROR_LEN);
+    for(i = 0; i < n; i++) {
+        span = &ctx->errorSpans[ctx->nErrors + i];
+        *span = d->spans[i];
+        if(span->offset >= 0) span->offset += d->first->offset;
+    }
+    ctx->nErrors += n;
+    if(ctx->nErrors == MAX_ERRORS) longjmp(ctx->fatal, RES_TOO_MANY_ERRORS);
+}
+
+// Parses the body of d again with the symbol table it had the first time: the symbols
+// of the declarations after it are set aside meanwhile. Returns RES_INVALID, leaving
+// the symbols as they were, when the body no longer ends at the same RACC.
+static int reparseFunc(Context *ctx, Decl *d) {
+    int nLater = ctx->symbols.end - ctx->symbols.begin - d->symbolsEnd, mark, res;
+    Symbol **later, **p, *s;
+    Decl *e;
+    jmp_buf jb;
+    if((later = (Symbol**)malloc(nLater * sizeof(Symbol*) + 1)) == NULL) return RES_INVALID;
+    COUNT_ALLOC(ctx, nLater * sizeof(Symbol*) + 1);
+    if(ctx->trace) ctx->declStart = seconds();
+    memcpy(later, ctx->symbols.begin + d->symbolsEnd, nLater * sizeof(Symbol*));
+    ctx->symbols.end -= nLater;
+
+    if((res = setjmp(ctx->fatal)) == 0) {
+        ctx->nErrors = ctx->nLexErrors;
+        for(e = ctx->decls; e != d; e++) keepErrors(ctx, e);
+        mark = ctx->nErrors;
+        ctx->crtFunc = d->func;
+        ctx->crtDepth = 1;
+        startFrame(ctx);
+        for(p = d->func->args.begin; p != d->func->args.end; p++) {
+            s = addSymbol(ctx, &ctx->symbols, (*p)->name, CLS_VAR);
+            s->mem = MEM_ARG;
+            s->type = (*p)->type;
+            s->offset = frameSlot(ctx, &s->type, MEM_ARG);
+        }
+        ctx->crtDepth = 0;
+        ctx->currentToken = d->body;
+        ctx->recoverPoint = &jb;
+        if(setjmp(jb)) res = RES_INVALID;
+        else {
+            stmCompound(ctx);
+            endFrame(d->func);
+            res = ctx->consumedTk == d->end ? RES_OK : RES_INVALID;
+        }
+        ctx->recoverPoint = NULL;
+        if(res == RES_OK) {
+            TRACE(ctx, d->func->name, ctx->declStart);
+            saveErrors(ctx, d, mark, ctx->nErrors - mark);
+            for(e = d + 1; e != ctx->decls + ctx->nDecls; e++) keepErrors(ctx, e);
+            res = ctx->nErrors ? RES_ERRORS : RES_OK;
+        }
+    }
+    ctx->recoverPoint = NULL;
+    ctx->crtFunc = NULL;
+    ctx->crtDepth = 0;
+    STAT(ctx, depth = 0);
+    deleteSymbolsAfter(&ctx->symbols, d->func);
+    memcpy(ctx->symbols.end, later, nLater * sizeof(Symbol*));
+    ctx->symbols.end += nLater;
+    free(later);
+    return res;
+}
+
+// unit: ( importDecl | declStruct | declFunc | declVar )* END
+// Unlike the other rules it returns a RES_ code; RES_ERRORS also covers lexical errors.
+int unit(Context *ctx) {
+    jmp_buf jb;
+    int res;
+    double start = ctx->stats || ctx->trace ? seconds() : 0;
+    if(ctx->cached) return RES_INVALID;
+    fixTokens(ctx);
+    ctx->unaryFrom = NULL;
+    if(ctx->changed >= 0 && (res = reparseFunc(ctx, &ctx->decls[ctx->changed])) != RES_INVALID) {
+        ctx->changed = CHANGED_NONE;
+        STAT(ctx, parseTime += seconds() - start);
+        TRACE(ctx, "parse", start);
+        return res;
+    }
+    if((res = setjmp(ctx->fatal)) != 0) {
+        ctx->recoverPoint = NULL;
+        STAT(ctx, parseTime += seconds() - start);
+        TRACE(ctx, "parse", start);
+        return res;
+    }
+    deleteSymbolsAfter(&ctx->symbols, NULL);
+    freeDecls(ctx);
+    freeImports(ctx);
+    ctx->crtDepth = 0;
+    STAT(ctx, depth = 0);
+    ctx->crtFunc = ctx->crtStruct = NULL;
+    ctx->nErrors = ctx->nLexErrors;
+    ctx->currentToken = ctx->tokens;
+    ctx->recoverPoint = &jb;
+    if(setjmp(jb)) {
+        if(ctx->crtStruct) {
+            computeStructLayout(ctx, ctx->crtStruct);
+            ctx->crtStruct = NULL;
+        }
+        if(ctx->crtFunc) {
+            deleteSymbolsAfter(&ctx->symbols, ctx->crtFunc);
+            ctx->crtFunc = NULL;
+        }
+        ctx->crtDepth = 0;
+        STAT(ctx, depth = 0);
+        resync(ctx, 1);
+        endDecl(ctx, NULL);
+    }
 
     while(1) {
-        if(declStruct()) {}
-        else if(declFunc()) {}
-        else if(declVar()) {}
+        ctx->declFirst = ctx->currentToken;
+        ctx->declErrors = ctx->nErrors;
+        if(ctx->trace) ctx->declStart = seconds();
+        if(importDecl(ctx)) endDecl(ctx, NULL);
+        else if(declStruct(ctx)) endDecl(ctx, NULL);
+        else if(declFunc(ctx)) endDecl(ctx, ctx->symbols.end[-1]);    // declFunc leaves its symbol last
+        else if(declVar(ctx)) endDecl(ctx, NULL);
         else break;
     }
-    if(!consume(END)) tkerr(currentToken,"missing END token");
+    if(!consume(ctx, END)) tkerr(ctx, ctx->currentToken,"missing END token");
+    ctx->recoverPoint = NULL;
+    ctx->changed = CHANGED_NONE;
+    STAT(ctx, parseTime += seconds() - start);
+    TRACE(ctx, "parse", start);
 
-    return 1;
+    return ctx->nErrors ? RES_ERRORS : RES_OK;
+}
+
+// Parallel parsing. The first pass is unit() itself, with skipBodies set. A body that
+// parses on its own as it would inside unit() ends at the RACC the first pass found
+// and never unwinds past its own stmCompound; one that does not makes parallelUnit
+// fall back to unit().
+
+// First pass: steps over a function body to its matching RACC and leaves that in
+// consumedTk, as stmCompound would. A body still open at END is left to unit().
+static void skipBody(Context *ctx) {
+    int nest = 0;
+    if(ctx->currentToken->code != LACC) tkerr(ctx, ctx->currentToken, "compound statement expected");
+    do {
+        if(ctx->currentToken->code == LACC) nest++;
+        else if(ctx->currentToken->code == RACC) nest--;
+        else if(ctx->currentToken->code == END) longjmp(ctx->fatal, RES_INVALID);
+        ctx->consumedTk = ctx->currentToken;
+        ctx->currentToken = nextTk(ctx, ctx->currentToken);
+    } while(nest);
+}
+
+// The jobs of parallelUnit: the complete functions of ctx->decls, taken in turn by the threads.
+typedef struct{
+    Context *ctx;
+    int *jobs, nJobs;               // indices in ctx->decls
+    int *results;                   // RES_ code of each job
+    int next;                       // next job to take
+} Bodies;
+
+typedef struct{
+    Bodies *bodies;
+    Context *w;                     // a context of its own, sharing the text and tokens of bodies->ctx
+    Stats stats;
+    pthread_t thread;
+    int jobs;                       // bodies it parsed
+    double busy;                    // seconds it spent parsing them
+} BodyWorker;
+
+// Parses the body of d on w, seeing the symbols ctx had after d's declaration, and keeps
+// the errors in d. Returns RES_INVALID when the body does not parse as it would in unit().
+static int parseBody(Context *w, Decl *d, Context *ctx) {
+    Symbol **p, *s;
+    jmp_buf jb;
+    int res;
+    double start = w->trace ? seconds() : 0;
+    w->outer.begin = ctx->symbols.begin;
+    w->outer.end = w->outer.after = ctx->symbols.begin + d->symbolsEnd;
+    w->nErrors = 0;
+    w->unaryFrom = NULL;
+    if((res = setjmp(w->fatal)) == 0) {
+        w->crtFunc = d->func;
+        w->crtDepth = 1;
+        startFrame(w);
+        for(p = d->func->args.begin; p != d->func->args.end; p++) {
+            s = addSymbol(w, &w->symbols, (*p)->name, CLS_VAR);
+            s->mem = MEM_ARG;
+            s->type = (*p)->type;
+            s->offset = frameSlot(w, &s->type, MEM_ARG);
+        }
+        w->crtDepth = 0;
+        w->currentToken = d->body;
+        w->recoverPoint = &jb;
+        if(setjmp(jb)) res = RES_INVALID;
+        else {
+            stmCompound(w);
+            endFrame(d->func);
+            res = w->consumedTk == d->end ? RES_OK : RES_INVALID;
+        }
+        w->recoverPoint = NULL;
+        if(res == RES_OK) saveErrors(w, d, 0, w->nErrors);
+    } else if(res == RES_TOO_MANY_ERRORS) {
+        // unit() would stop in this body too, once the errors before it are counted
+        if(setjmp(w->fatal)) res = RES_FATAL;
+        else saveErrors(w, d, 0, w->nErrors);
+    }
+    w->recoverPoint = NULL;
+    w->crtFunc = NULL;
+    w->crtDepth = 0;
+    STAT(w, depth = 0);
+    deleteSymbolsAfter(&w->symbols, NULL);
+    TRACE(w, d->func->name, start);
+    return res;
+}
+
+static void *parseBodies(void *arg) {
+    BodyWorker *bw = (BodyWorker*)arg;
+    Bodies *b = bw->bodies;
+    double start = b->ctx->stats ? seconds() : 0;
+    int i;
+    while((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->nJobs) {
+        b->results[i] = parseBody(bw->w, &b->ctx->decls[b->jobs[i]], b->ctx);
+        bw->jobs++;
+    }
+    if(b->ctx->stats) bw->busy = seconds() - start;
+    return NULL;
+}
+
+// Puts the errors back in the order unit() finds them: lexical, then declaration by
+// declaration, then the nTail ones found after the last complete declaration.
+// Returns the result unit() would have.
+static int mergeErrors(Context *ctx, char (*tail)[MAX_ERROR_LEN], Span *tailSpans, int nTail) {
+    int res, i;
+    ctx->nErrors = ctx->nLexErrors;
+    if((res = setjmp(ctx->fatal)) != 0) return res;
+    for(i = 0; i < ctx->nDecls; i++) keepErrors(ctx, &ctx->decls[i]);
+    i = nTail < MAX_ERRORS - ctx->nErrors ? nTail : MAX_ERRORS - ctx->nErrors;
+    if(i > 0) {
+        memcpy(ctx->errors + ctx->nErrors, tail, i * MAX_ERROR_LEN);
+        memcpy(ctx->errorSpans + ctx->nErrors, tailSpans, i * sizeof(Span));
+        ctx->nErrors += i;
+    }
+    if(ctx->nErrors == MAX_ERRORS) return RES_TOO_MANY_ERRORS;
+    return ctx->nErrors ? RES_ERRORS : RES_OK;
+}
+
+int parallelUnit(Context *ctx, int nThreads) {
+    BodyWorker workers[MAX_THREADS];
+    Bodies bodies;
+    char (*tail)[MAX_ERROR_LEN] = NULL;
+    Span *tailSpans = NULL;
+    double start;
+    int res, nWorkers, nTail, i, k;
+
+    if(nThreads > MAX_THREADS) nThreads = MAX_THREADS;
+    if(nThreads < 2 || ctx->streaming || ctx->cached || ctx->changed >= 0) return unit(ctx);
+    ctx->skipBodies = 1;
+    res = unit(ctx);
+    ctx->skipBodies = 0;
+    if(res == RES_INVALID) {
+        STAT(ctx, fallbacks++);
+        return unit(ctx);
+    }
+    if(res == RES_FATAL) return res;
+    start = ctx->stats || ctx->trace ? seconds() : 0;
+
+    memset(&bodies, 0, sizeof(bodies));
+    bodies.ctx = ctx;
+    if((bodies.jobs = (int*)malloc((ctx->nDecls + 1) * sizeof(int))) == NULL ||
+            (bodies.results = (int*)malloc((ctx->nDecls + 1) * sizeof(int))) == NULL) {
+        free(bodies.jobs);
+        STAT(ctx, fallbacks++);
+        return unit(ctx);
+    }
+    COUNT_ALLOC(ctx, (ctx->nDecls + 1) * sizeof(int));
+    COUNT_ALLOC(ctx, (ctx->nDecls + 1) * sizeof(int));
+    // errors found after the last complete declaration, when the first pass gave up
+    nTail = ctx->nErrors - ctx->nLexErrors;
+    for(i = 0; i < ctx->nDecls; i++) {
+        nTail -= ctx->decls[i].nErrors;
+        if(ctx->decls[i].func) bodies.jobs[bodies.nJobs++] = i;
+    }
+    if(nTail && ((tail = malloc(nTail * MAX_ERROR_LEN)) == NULL || (tailSpans = (Span*)malloc(nTail * sizeof(Span))) == NULL)) {
+        res = RES_INVALID;
+    } else if(nTail) {
+        COUNT_ALLOC(ctx, nTail * MAX_ERROR_LEN);
+        COUNT_ALLOC(ctx, nTail * sizeof(Span));
+        memcpy(tail, ctx->errors + ctx->nErrors - nTail, nTail * MAX_ERROR_LEN);
+        memcpy(tailSpans, ctx->errorSpans + ctx->nErrors - nTail, nTail * sizeof(Span));
+    }
+
+    for(nWorkers = 0; res != RES_INVALID && nWorkers < nThreads; nWorkers++) {
+        BodyWorker *bw = &workers[nWorkers];
+        if((bw->w = createContext()) == NULL) break;
+        bw->bodies = &bodies;
+        bw->jobs = 0;
+        bw->busy = 0;
+        bw->w->text = ctx->text;
+        bw->w->lineStarts = ctx->lineStarts;
+        bw->w->line = ctx->line;
+        if(ctx->stats) {
+            memset(&bw->stats, 0, sizeof(Stats));
+            bw->w->stats = &bw->stats;
+        }
+        bw->w->trace = ctx->trace;
+        bw->w->traceTid = ctx->traceTid + PIPE_TID + nWorkers;
+        bw->w->traceFile = ctx->traceFile;
+        if(nWorkers && pthread_create(&bw->thread, NULL, parseBodies, bw) != 0) {
+            bw->w->lineStarts = NULL;
+            freeContext(bw->w);
+            break;
+        }
+    }
+    if(nWorkers) parseBodies(&workers[0]);
+    else res = RES_INVALID;
+    for(k = 0; k < nWorkers; k++) {
+        if(k) pthread_join(workers[k].thread, NULL);
+        if(ctx->stats) {
+            for(i = 0; i < BT_N; i++) ctx->stats->backtracks[i] += workers[k].stats.backtracks[i];
+            if(workers[k].stats.maxDepth > ctx->stats->maxDepth) ctx->stats->maxDepth = workers[k].stats.maxDepth;
+            ctx->stats->allocs += workers[k].stats.allocs;
+            ctx->stats->allocBytes += workers[k].stats.allocBytes;
+            ctx->stats->workerJobs[k] = workers[k].jobs;
+            ctx->stats->workerBusy[k] = workers[k].busy;
+        }
+        workers[k].w->lineStarts = NULL;
+        freeContext(workers[k].w);
+    }
+    for(i = 0; res != RES_INVALID && i < bodies.nJobs; i++) {
+        if(bodies.results[i] == RES_INVALID || bodies.results[i] == RES_FATAL) res = RES_INVALID;
+    }
+
+    if(res != RES_INVALID) res = mergeErrors(ctx, tail, tailSpans, nTail);
+    free(tail);
+    free(tailSpans);
+    free(bodies.jobs);
+    free(bodies.results);
+    STAT(ctx, nWorkers = nWorkers);
+    STAT(ctx, workerWall = seconds() - start);
+    STAT(ctx, parseTime += seconds() - start);
+    TRACE(ctx, "parse bodies", start);
+    if(res == RES_INVALID) {
+        STAT(ctx, fallbacks++);
+        return unit(ctx);
+    }
+    STAT(ctx, bodies += bodies.nJobs);
+    return res;
 }
 
 
+// importDecl: ID STRING SEMICOLON, where the ID is "import"; see importFile
+static int importDecl(Context *ctx) {
+    Token *tkPath;
+    if(ctx->currentToken->code != ID || strcmp(ctx->currentToken->text, "import")) return 0;
+    consume(ctx, ID);
+    if(!consume(ctx, STRING)) tkerr(ctx, ctx->currentToken, "file name expected after import");
+    tkPath = ctx->consumedTk;
+    if(ctx->currentToken->code != SEMICOLON) tkerr(ctx, ctx->currentToken, "missing ; after import");
+    importFile(ctx, tkPath);            // after an error, resync goes on from the SEMICOLON
+    consume(ctx, SEMICOLON);
+    return 1;
+}
+
 // declStruct: STRUCT ID LACC declVar* RACC SEMICOLON
-int declStruct() {
-    Token *startTk = currentToken;
-    if(!consume(STRUCT)) return 0;
-    if(!consume(ID)) tkerr(currentToken,"ID expected after struct");
-    if(!consume(LACC)){
-       currentToken = startTk;
+static int declStruct(Context *ctx) {
+    Token *startTk = ctx->currentToken, *tkName;
+    Symbol *s;
+    jmp_buf jb, *prev;
+    if(!consume(ctx, STRUCT)) return 0;
+    if(!consume(ctx, ID)) tkerr(ctx, ctx->currentToken,"ID expected after struct");
+    tkName = ctx->consumedTk;
+    if(!consume(ctx, LACC)){
+       ctx->currentToken = startTk;
+        STAT(ctx, backtracks[BT_DECLSTRUCT]++);
         return 0;
     }
+    if(lookup(ctx, tkName->text)) tkerr(ctx, tkName, "symbol redefinition: %s", tkName->text);
+    ctx->crtStruct = addSymbol(ctx, &ctx->symbols, tkName->text, CLS_STRUCT);
+    initSymbols(&ctx->crtStruct->members);
+    prev = ctx->recoverPoint;
+    ctx->recoverPoint = &jb;
+    if(setjmp(jb)) {
+        STAT(ctx, depth = 0);
+        resync(ctx, 0);
+    }
     while(1) {
-        if(declVar()) {}
+        if(declVar(ctx)) {}
+        else if(ctx->currentToken->code != RACC && ctx->currentToken->code != END)
+            tkerr(ctx, ctx->currentToken, "member declaration expected in struct");
         else break;
     }
-    if(!consume(RACC)) tkerr(currentToken,"Missing } in struct declaration");
-    if(!consume(SEMICOLON)) tkerr(currentToken,"Missing ; in struct declaration");
+    ctx->recoverPoint = prev;
+    if(!consume(ctx, RACC)) tkerr(ctx, ctx->currentToken,"Missing } in struct declaration");
+    s = ctx->crtStruct;
+    ctx->crtStruct = NULL;
+    if(!computeStructLayout(ctx, s)) tkerr(ctx, tkName, "struct %s too large", tkName->text);
+    if(!consume(ctx, SEMICOLON)) tkerr(ctx, ctx->currentToken,"Missing ; in struct declaration");
     return 1;
 }
 
 // declVar:  typeBase ID arrayDecl? ( COMMA ID arrayDecl? )* SEMICOLON
-int declVar() {
+static int declVar(Context *ctx) {
     //Token *startTk = currentToken;
-    if(!typeBase()) return 0;
-    if(!consume(ID)) tkerr(currentToken, "ID expected after type base");
-    if(!arrayDecl()) { }
+    Type base, t;
+    Token *tkName;
+    if(!typeBase(ctx, &base)) return 0;
+    if(!consume(ctx, ID)) tkerr(ctx, ctx->currentToken, "ID expected after type base");
+    tkName = ctx->consumedTk;
+    t = base;
+    if(!arrayDecl(ctx, &t)) t.nElements = -1;
+    addVar(ctx, tkName, &t);
     while(1) {
 
-        if(!consume(COMMA)) break;
-        if(!consume(ID)) tkerr(currentToken, "ID expected");
-        if(!arrayDecl()) {}
-    }
-    if(!consume(SEMICOLON)) {
-        return 0;
+        if(!consume(ctx, COMMA)) break;
+        if(!consume(ctx, ID)) tkerr(ctx, ctx->currentToken, "ID expected");
+        tkName = ctx->consumedTk;
+        t = base;
+        if(!arrayDecl(ctx, &t)) t.nElements = -1;
+        addVar(ctx, tkName, &t);
     }
+    if(!consume(ctx, SEMICOLON)) tkerr(ctx, ctx->currentToken, "missing ; after variable declaration");
     return 1;
 }
 
 // typeBase: INT | DOUBLE | CHAR | STRUCT ID
-int typeBase() {
-    if(consume(INT)) {}
-    else if(consume(DOUBLE)) {}
-    else if(consume(CHAR)) {}
-    else if(consume(STRUCT)) {
-        if(!consume(ID)) tkerr(currentToken, "ID expected after struct");
+static int typeBase(Context *ctx, Type *ret) {
+    ret->s = NULL;
+    if(consume(ctx, INT)) ret->typeBase = TB_INT;
+    else if(consume(ctx, DOUBLE)) ret->typeBase = TB_DOUBLE;
+    else if(consume(ctx, CHAR)) ret->typeBase = TB_CHAR;
+    else if(consume(ctx, STRUCT)) {
+        if(!consume(ctx, ID)) tkerr(ctx, ctx->currentToken, "ID expected after struct");
+        ret->typeBase = TB_STRUCT;
+        ret->s = lookup(ctx, ctx->consumedTk->text);
+        if(ret->s == NULL || ret->s->cls != CLS_STRUCT) tkerr(ctx, ctx->consumedTk, "undefined struct: %s", ctx->consumedTk->text);
     }
     else return 0;
     return 1;
 }
 //arrayDecl: LBRACKET expr? RBRACKET ;
-int arrayDecl() {
-    if(!consume(LBRACKET)) return 0;
-    expr();
-    if(!consume(RBRACKET)) tkerr(currentToken, "missing ] from array declaration");
+// nElements is the size when it is a plain CT_INT, otherwise 0 (unknown)
+static int arrayDecl(Context *ctx, Type *ret) {
+    if(!consume(ctx, LBRACKET)) return 0;
+    ret->nElements = 0;
+    if(ctx->currentToken->code == CT_INT && nextTk(ctx, ctx->currentToken)->code == RBRACKET) {
+        if(ctx->currentToken->i > INT_MAX) tkerr(ctx, ctx->currentToken, "array too large");
+        ret->nElements = (int)ctx->currentToken->i;
+    }
+    expr(ctx);
+    if(!consume(ctx, RBRACKET)) tkerr(ctx, ctx->currentToken, "missing ] from array declaration");
     return 1;
 }
 
 // typeName: typeBase arrayDecl?
-int typeName1() {
-    if(!typeBase()) return 0;
-    if(!arrayDecl()) {}
+static int typeName1(Context *ctx, Type *ret) {
+    if(!typeBase(ctx, ret)) return 0;
+    if(!arrayDecl(ctx, ret)) ret->nElements = -1;
     return 1;
 }
 
 // declFunc: ( typeBase MUL? | VOID ) ID
 //                         LPAR ( funcArg ( COMMA funcArg )* )? RPAR
 //                         stmCompound
-int declFunc() {
-   Token *back = currentToken;
-    if(typeBase()) {
-        if(consume(MUL)) {}
-    } else if (consume(VOID)) {}
+static int declFunc(Context *ctx) {
+   Token *back = ctx->currentToken, *tkName;
+   Type t;
+    if(typeBase(ctx, &t)) {
+        if(consume(ctx, MUL)) t.nElements = 0;
+        else t.nElements = -1;
+    } else if (consume(ctx, VOID)) {
+        t.typeBase = TB_VOID;
+        t.s = NULL;
+        t.nElements = -1;
+    }
     else return 0;
-    if(!consume(ID)) {
-        currentToken = back;
+    if(!consume(ctx, ID)) {
+        ctx->currentToken = back;
+        STAT(ctx, backtracks[BT_DECLFUNC]++);
         return 0;
     }
-    if(!consume(LPAR)) {
-        currentToken = back;
+    tkName = ctx->consumedTk;
+    if(!consume(ctx, LPAR)) {
+        ctx->currentToken = back;
+        STAT(ctx, backtracks[BT_DECLFUNC]++);
         return 0;
     }
-
-    if(funcArg()) {
+    if(lookup(ctx, tkName->text)) tkerr(ctx, tkName, "symbol redefinition: %s", tkName->text);
+    ctx->crtFunc = addSymbol(ctx, &ctx->symbols, tkName->text, CLS_FUNC);
+    initSymbols(&ctx->crtFunc->args);
+    ctx->crtFunc->type = t;
+    ctx->crtDepth++;
+    startFrame(ctx);
+
+    if(funcArg(ctx)) {
         while(1) {
-            if(consume(COMMA)){
-                if(!funcArg()) tkerr(currentToken, "missing func arg in stm");
+            if(consume(ctx, COMMA)){
+                if(!funcArg(ctx)) tkerr(ctx, ctx->currentToken, "missing func arg in stm");
             }
             else
                 break;
         }
     }
-    if(!consume(RPAR)) tkerr(currentToken, "missing ) in func declaration");
-
-    if(!stmCompound()) tkerr(currentToken, "compound statement expected");
+    if(!consume(ctx, RPAR)) tkerr(ctx, ctx->currentToken, "missing ) in func declaration");
+    ctx->crtDepth--;
+
+    if(ctx->skipBodies) skipBody(ctx);
+    else if(!stmCompound(ctx)) tkerr(ctx, ctx->currentToken, "compound statement expected");
+    endFrame(ctx->crtFunc);
+    deleteSymbolsAfter(&ctx->symbols, ctx->crtFunc);
+    ctx->crtFunc = NULL;
     return 1;
 }
 
 // funcArg: typeBase ID arrayDecl?
-int funcArg() {
-    if(!typeBase()) return 0;
-    if(!consume(ID)) tkerr(currentToken, "ID missing in function declaration");
-    if(!arrayDecl()) {}
+static int funcArg(Context *ctx) {
+    Type t;
+    Token *tkName;
+    Symbol *s;
+    int offset;
+    if(!typeBase(ctx, &t)) return 0;
+    if(!consume(ctx, ID)) tkerr(ctx, ctx->currentToken, "ID missing in function declaration");
+    tkName = ctx->consumedTk;
+    if(!arrayDecl(ctx, &t)) t.nElements = -1;
+    s = lookup(ctx, tkName->text);
+    if(s && s->depth == ctx->crtDepth) tkerr(ctx, tkName, "symbol redefinition: %s", tkName->text);
+    s = addSymbol(ctx, &ctx->symbols, tkName->text, CLS_VAR);
+    s->mem = MEM_ARG;
+    s->type = t;
+    if((s->offset = frameSlot(ctx, &t, MEM_ARG)) < 0) tkerr(ctx, tkName, "frame of %s too large", ctx->crtFunc->name);
+    offset = s->offset;
+    s = addSymbol(ctx, &ctx->crtFunc->args, tkName->text, CLS_VAR);
+    s->mem = MEM_ARG;
+    s->type = t;
+    s->offset = offset;
     return 1;
 }
 
@@ -745,77 +3017,105 @@ int funcArg() {
 //            | BREAK SEMICOLON
 //            | RETURN expr? SEMICOLON
 //            | expr? SEMICOLON
-int stm() {
-    if(stmCompound()) {}
-    else if(consume(IF)) {
-        if(!consume(LPAR)) tkerr(currentToken, "missing ( after if") ;
-        if(!expr()) tkerr(currentToken, "Expected expression after ( ");
-        if(!consume(RPAR)) tkerr(currentToken, "missing ) after if") ;
-        if(!stm()) tkerr(currentToken, "Expected statement after if ") ;
-        if(consume(ELSE)) {
-            if(!stm()) tkerr(currentToken, "Expected statement after else ") ;
+static int stm(Context *ctx) {
+    ENTER_RULE(ctx);
+    if(stmCompound(ctx)) {}
+    else if(consume(ctx, IF)) {
+        if(!consume(ctx, LPAR)) tkerr(ctx, ctx->currentToken, "missing ( after if") ;
+        if(!expr(ctx)) tkerr(ctx, ctx->currentToken, "Expected expression after ( ");
+        if(!consume(ctx, RPAR)) tkerr(ctx, ctx->currentToken, "missing ) after if") ;
+        if(!stm(ctx)) tkerr(ctx, ctx->currentToken, "Expected statement after if ") ;
+        if(consume(ctx, ELSE)) {
+            if(!stm(ctx)) tkerr(ctx, ctx->currentToken, "Expected statement after else ") ;
         }
     }
-    else if(consume(WHILE)) {
-        if(!consume(LPAR)) tkerr(currentToken, "missing ( after while") ;
-        if(!expr()) tkerr(currentToken, "Expected expression after ( ") ;
-        if(!consume(RPAR)) tkerr(currentToken, "missing ) after while") ;
-        if(!stm()) tkerr(currentToken, "Expected statement after while ") ;
-    }
-    else if(consume(FOR)) {
-        if(!consume(LPAR)) tkerr(currentToken, "missing ( after for") ;
-        expr();
-        if(!consume(SEMICOLON)) tkerr(currentToken, "missing ; in for") ;
-        expr();
-        if(!consume(SEMICOLON)) tkerr(currentToken, "missing ; in for") ;
-        expr();
-        if(!consume(RPAR)) tkerr(currentToken, "missing ) after for") ;
-        if(!stm()) tkerr(currentToken, "Expected statement after for ") ;
-    }
-    else if(consume(BREAK)) {
-        if(!consume(SEMICOLON)) tkerr(currentToken, "missing ; after break") ;
-    }
-    else if(consume(RETURN)) {
-        expr();
-        if(!consume(SEMICOLON)) tkerr(currentToken, "missing ; after return") ;
-    }
-    else if(expr()) {
-        if(!consume(SEMICOLON)) tkerr(currentToken,"missing ; after expression in statement");
-    }
-    else if(consume(SEMICOLON)) {}
-    else return 0;
+    else if(consume(ctx, WHILE)) {
+        if(!consume(ctx, LPAR)) tkerr(ctx, ctx->currentToken, "missing ( after while") ;
+        if(!expr(ctx)) tkerr(ctx, ctx->currentToken, "Expected expression after ( ") ;
+        if(!consume(ctx, RPAR)) tkerr(ctx, ctx->currentToken, "missing ) after while") ;
+        if(!stm(ctx)) tkerr(ctx, ctx->currentToken, "Expected statement after while ") ;
+    }
+    else if(consume(ctx, FOR)) {
+        if(!consume(ctx, LPAR)) tkerr(ctx, ctx->currentToken, "missing ( after for") ;
+        expr(ctx);
+        if(!consume(ctx, SEMICOLON)) tkerr(ctx, ctx->currentToken, "missing ; in for") ;
+        expr(ctx);
+        if(!consume(ctx, SEMICOLON)) tkerr(ctx, ctx->currentToken, "missing ; in for") ;
+        expr(ctx);
+        if(!consume(ctx, RPAR)) tkerr(ctx, ctx->currentToken, "missing ) after for") ;
+        if(!stm(ctx)) tkerr(ctx, ctx->currentToken, "Expected statement after for ") ;
+    }
+    else if(consume(ctx, BREAK)) {
+        if(!consume(ctx, SEMICOLON)) tkerr(ctx, ctx->currentToken, "missing ; after break") ;
+    }
+    else if(consume(ctx, RETURN)) {
+        expr(ctx);
+        if(!consume(ctx, SEMICOLON)) tkerr(ctx, ctx->currentToken, "missing ; after return") ;
+    }
+    else if(expr(ctx)) {
+        if(!consume(ctx, SEMICOLON)) tkerr(ctx, ctx->currentToken,"missing ; after expression in statement");
+    }
+    else if(consume(ctx, SEMICOLON)) {}
+    else {
+        STAT(ctx, depth--);
+        return 0;
+    }
+    STAT(ctx, depth--);
     return 1;
 }
 
 // stmCompound: LACC ( declVar | stm )* RACC
-int stmCompound() {
-    if(!consume(LACC)) return 0;
+static int stmCompound(Context *ctx) {
+    Symbol *start = ctx->symbols.end > ctx->symbols.begin ? ctx->symbols.end[-1] : NULL;
+    jmp_buf jb, *prev;
+    int depth, ruleDepth = ctx->stats ? ctx->stats->depth : 0, frameTop = ctx->frameTop;
+    if(!consume(ctx, LACC)) return 0;
+    depth = ++ctx->crtDepth;
+    prev = ctx->recoverPoint;
+    ctx->recoverPoint = &jb;
+    if(setjmp(jb)) {
+        // drop what nested blocks left behind when their own RACC was missing
+        ctx->crtDepth = depth;
+        STAT(ctx, depth = ruleDepth);
+        while(ctx->symbols.end > ctx->symbols.begin && ctx->symbols.end[-1]->depth > depth) freeSymbol(*--ctx->symbols.end);
+        resync(ctx, 0);
+    }
     while(1) {
-        if(declVar()) {}
-        else if(stm()) {}
+        if(declVar(ctx)) {}
+        else if(stm(ctx)) {}
+        else if(ctx->currentToken->code != RACC && ctx->currentToken->code != END)
+            tkerr(ctx, ctx->currentToken, "Expected } in compound statement");
         else break;
     }
-    if(!consume(RACC)) tkerr(currentToken, "Expected } in compound statement");
+    ctx->recoverPoint = prev;
+    if(!consume(ctx, RACC)) tkerr(ctx, ctx->currentToken, "Expected } in compound statement");
+    ctx->crtDepth--;
+    deleteSymbolsAfter(&ctx->symbols, start);
+    ctx->frameTop = frameTop;           // the next block reuses the bytes of this one's locals
     return 1;
 }
 
 // expr: exprAssign
-int expr() {
-    if(!exprAssign()) return 0;
-    return 1;
+static int expr(Context *ctx) {
+    int res;
+    ENTER_RULE(ctx);
+    res = exprAssign(ctx);
+    STAT(ctx, depth--);
+    return res;
 }
 
 // exprAssign: exprUnary ASSIGN exprAssign | exprOr
-int exprAssign() {
-    Token *startTk = currentToken;
-    if(exprUnary()) {
-        if(consume(ASSIGN)) {
-            if(!exprAssign()) tkerr(currentToken, "Expected assign in expression");
+static int exprAssign(Context *ctx) {
+    Token *startTk = ctx->currentToken;
+    if(exprUnary(ctx)) {
+        if(consume(ctx, ASSIGN)) {
+            if(!exprAssign(ctx)) tkerr(ctx, ctx->currentToken, "Expected assign in expression");
             return 1;
         }
-      currentToken = startTk;
+      ctx->currentToken = startTk;
+      STAT(ctx, backtracks[BT_EXPRASSIGN]++);
     }
-    if(exprOr()) {}
+    if(exprOr(ctx)) {}
     else return 0;
     return 1;
 }
@@ -824,16 +3124,16 @@ int exprAssign() {
 // Remove left recursion:
 //     exprOr: exprAnd exprOr1
 //     exprOr1: OR exprAnd exprOr1
-int exprOr() {
-    if(!exprAnd()) return 0;
-    exprOr1();
+static int exprOr(Context *ctx) {
+    if(!exprAnd(ctx)) return 0;
+    exprOr1(ctx);
     return 1;
 }
 
-void exprOr1() {
-    if(consume(OR)) {
-        if(!exprAnd()) tkerr(currentToken,"missing expression after OR");
-        exprOr1();
+static void exprOr1(Context *ctx) {
+    if(consume(ctx, OR)) {
+        if(!exprAnd(ctx)) tkerr(ctx, ctx->currentToken,"missing expression after OR");
+        exprOr1(ctx);
     }
 }
 
@@ -841,16 +3141,16 @@ void exprOr1() {
 // Remove left recursion:
 //     exprAnd: exprEq exprAnd1
 //     exprAnd1: AND exprEq exprAnd1
-int exprAnd() {
-    if(!exprEq()) return 0;
-    exprAnd1();
+static int exprAnd(Context *ctx) {
+    if(!exprEq(ctx)) return 0;
+    exprAnd1(ctx);
     return 1;
 }
 
-void exprAnd1() {
-    if(consume(AND)) {
-        if(!exprEq()) tkerr(currentToken,"missing expression after AND");
-        exprAnd1();
+static void exprAnd1(Context *ctx) {
+    if(consume(ctx, AND)) {
+        if(!exprEq(ctx)) tkerr(ctx, ctx->currentToken,"missing expression after AND");
+        exprAnd1(ctx);
     }
 }
 
@@ -858,103 +3158,116 @@ void exprAnd1() {
 // Remove left recursion:
 //     exprEq: exprRel exprEq1
 //     exprEq1: ( EQUAL | NOTEQ ) exprRel exprEq1
-int exprEq() {
-    if(!exprRel()) return 0;
-    exprEq1();
+static int exprEq(Context *ctx) {
+    if(!exprRel(ctx)) return 0;
+    exprEq1(ctx);
     return 1;
 }
 
-void exprEq1() {
-    if(consume(EQUAL)) {}
-    else if(consume(NEQUAL)) {}
+static void exprEq1(Context *ctx) {
+    if(consume(ctx, EQUAL)) {}
+    else if(consume(ctx, NEQUAL)) {}
     else return;
-    if(!exprRel()) tkerr(currentToken,"missing expressiong after =");
-    exprEq1();
+    if(!exprRel(ctx)) tkerr(ctx, ctx->currentToken,"missing expressiong after =");
+    exprEq1(ctx);
 }
 
 // exprRel: exprRel ( LESS | LESSEQ | GREATER | GREATEREQ ) exprAdd | exprAdd
 // Remove left recursion:
 //     exprRel: exprAdd exprRel1
 //     exprRel1: ( LESS | LESSEQ | GREATER | GREATEREQ ) exprAdd exprRel1
-int exprRel() {
-    if(!exprAdd()) return 0;
-    exprRel1();
+static int exprRel(Context *ctx) {
+    if(!exprAdd(ctx)) return 0;
+    exprRel1(ctx);
     return 1;
 }
 
-void exprRel1() {
-    if(consume(LESS)) {}
-    else if(consume(LESSEQ)) {}
-    else if(consume(GREATER)) {}
-    else if(consume(GREATEREQ)) {}
+static void exprRel1(Context *ctx) {
+    if(consume(ctx, LESS)) {}
+    else if(consume(ctx, LESSEQ)) {}
+    else if(consume(ctx, GREATER)) {}
+    else if(consume(ctx, GREATEREQ)) {}
     else return;
-    if(!exprAdd()) tkerr(currentToken,"missing expression after relationship");
-    exprRel1();
+    if(!exprAdd(ctx)) tkerr(ctx, ctx->currentToken,"missing expression after relationship");
+    exprRel1(ctx);
 }
 
 // exprAdd: exprAdd ( ADD | SUB ) exprMul | exprMul
 // Remove left recursion:
 //     exprAdd: exprMul exprAdd1
 //     exprAdd1: ( ADD | SUB ) exprMul exprAdd1
-int exprAdd() {
-    if(!exprMul()) return 0;
-    exprAdd1();
+static int exprAdd(Context *ctx) {
+    if(!exprMul(ctx)) return 0;
+    exprAdd1(ctx);
     return 1;
 }
 
-void exprAdd1() {
-    if(consume(ADD)) {}
-    else if(consume(SUB)) {}
+static void exprAdd1(Context *ctx) {
+    if(consume(ctx, ADD)) {}
+    else if(consume(ctx, SUB)) {}
     else return;
-    if(!exprMul()) tkerr(currentToken,"missing expressiong after + or -");
-    exprAdd1();
+    if(!exprMul(ctx)) tkerr(ctx, ctx->currentToken,"missing expressiong after + or -");
+    exprAdd1(ctx);
 }
 
 // exprMul: exprMul ( MUL | DIV ) exprCast | exprCast
 // Remove left recursion:
 //     exprMul: exprCast exprMul1
 //     exprMul1: ( MUL | DIV ) exprCast exprMul1
-int exprMul() {
-    if(!exprCast()) return 0;
-    exprMul1();
+static int exprMul(Context *ctx) {
+    if(!exprCast(ctx)) return 0;
+    exprMul1(ctx);
     return 1;
 }
 
-void exprMul1() {
-    if(consume(MUL)) {}
-    else if(consume(DIV)) {}
+static void exprMul1(Context *ctx) {
+    if(consume(ctx, MUL)) {}
+    else if(consume(ctx, DIV)) {}
     else return;
-    if(!exprCast()) tkerr(currentToken,"missing expressiong after * or /");
-    exprMul1();
+    if(!exprCast(ctx)) tkerr(ctx, ctx->currentToken,"missing expressiong after * or /");
+    exprMul1(ctx);
 }
 
 // exprCast: LPAR typeName RPAR exprCast | exprUnary
-int exprCast() {
-    Token *startTk = currentToken;
-    if(consume(LPAR)) {
-        if(typeName1(NULL)) {
-            if(consume(RPAR)) {
-                if(exprCast()) { return 1; }
+static int exprCast(Context *ctx) {
+    Token *startTk = ctx->currentToken;
+    Type t;
+    if(consume(ctx, LPAR)) {
+        if(typeName1(ctx, &t)) {
+            if(consume(ctx, RPAR)) {
+                if(exprCast(ctx)) { return 1; }
             }
         }
-        currentToken = startTk;
+        ctx->currentToken = startTk;
+        STAT(ctx, backtracks[BT_EXPRCAST]++);
     }
-    if(exprUnary()) {}
+    if(exprUnary(ctx)) {}
     else return 0;
     return 1;
 }
 
 // exprUnary: ( SUB | NOT ) exprUnary | exprPostfix
-int exprUnary() {
-    if(consume(SUB)) {
-        if(!exprUnary()) tkerr(currentToken,"missing unary expression after -");
+// exprAssign backtracks over it when no ASSIGN follows, and exprCast then tries it again
+// from the same token. That second try reuses the result of the first; otherwise every
+// level of parentheses would double the parsing time.
+static int exprUnary(Context *ctx) {
+    Token *startTk = ctx->currentToken;
+    int res = 1;
+    if(startTk == ctx->unaryFrom) {
+        if(ctx->unaryTo) ctx->currentToken = ctx->unaryTo;
+        return ctx->unaryTo != NULL;
     }
-    else if(consume(NOT)) {
-        if(!exprUnary()) tkerr(currentToken,"missing unary expression after !");
+    if(consume(ctx, SUB)) {
+        if(!exprUnary(ctx)) tkerr(ctx, ctx->currentToken,"missing unary expression after -");
     }
-    else if(exprPostfix()) {}
-    else return 0;
-    return 1;
+    else if(consume(ctx, NOT)) {
+        if(!exprUnary(ctx)) tkerr(ctx, ctx->currentToken,"missing unary expression after !");
+    }
+    else if(exprPostfix(ctx)) {}
+    else res = 0;
+    ctx->unaryFrom = startTk;
+    ctx->unaryTo = res ? ctx->currentToken : NULL;
+    return res;
 }
 
 // exprPostfix: exprPostfix LBRACKET expr RBRACKET
@@ -963,20 +3276,31 @@ int exprUnary() {
 // Remove left recursion:
 //     exprPostfix: exprPrimary exprPostfix1
 //     exprPostfix1: ( LBRACKET expr RBRACKET | DOT ID ) exprPostfix1
-int exprPostfix() {
-    if(!exprPrimary()) return 0;
-    exprPostfix1();
+// t follows the type along the chain; typeBase is TB_VOID when it is not known
+// (undeclared external functions, parenthesized expressions)
+static int exprPostfix(Context *ctx) {
+    Type t;
+    if(!exprPrimary(ctx, &t)) return 0;
+    exprPostfix1(ctx, &t);
     return 1;
 }
 
-void exprPostfix1() {
-    if(consume(LBRACKET)) {
-        if(!expr()) tkerr(currentToken,"missing expression after (");
-        if(!consume(RBRACKET)) tkerr(currentToken,"missing ) after expression");
-    } else if(consume(DOT)) {
-        if(!consume(ID)) tkerr(currentToken,"error");
+static void exprPostfix1(Context *ctx, Type *t) {
+    Symbol *m;
+    if(consume(ctx, LBRACKET)) {
+        if(!expr(ctx)) tkerr(ctx, ctx->currentToken,"missing expression after (");
+        if(!consume(ctx, RBRACKET)) tkerr(ctx, ctx->currentToken,"missing ) after expression");
+        t->nElements = -1;
+    } else if(consume(ctx, DOT)) {
+        if(!consume(ctx, ID)) tkerr(ctx, ctx->currentToken,"error");
+        if(t->typeBase == TB_STRUCT) {
+            if(t->nElements >= 0) tkerr(ctx, ctx->consumedTk, "field %s selected from an array", ctx->consumedTk->text);
+            if((m = findMember(t->s, ctx->consumedTk->text)) == NULL)
+                tkerr(ctx, ctx->consumedTk, "struct %s does not have a field %s", t->s->name, ctx->consumedTk->text);
+            *t = m->type;
+        }
     } else return;
-    exprPostfix1();
+    exprPostfix1(ctx, t);
 }
 
 // exprPrimary: ID ( LPAR ( expr ( COMMA expr )* )? RPAR )?
@@ -985,40 +3309,64 @@ void exprPostfix1() {
 //            | CT_CHAR
 //            | CT_STRING
 //            | LPAR expr RPAR
-int exprPrimary() {
-    Token *startTk = currentToken;
-    if(consume(ID)) {
-        if(consume(LPAR)) {
-            if(expr()) {
+static int exprPrimary(Context *ctx, Type *t) {
+    Token *startTk = ctx->currentToken;
+    Symbol *s;
+    t->typeBase = TB_VOID;
+    t->s = NULL;
+    t->nElements = -1;
+    if(consume(ctx, ID)) {
+        if((s = lookup(ctx, ctx->consumedTk->text)) != NULL) *t = s->type;
+        if(consume(ctx, LPAR)) {
+            if(expr(ctx)) {
                 while(1) {
-                    if(!consume(COMMA)) break;
-                    if(!expr()) tkerr(currentToken,"missing expression after , in primary expression");
+                    if(!consume(ctx, COMMA)) break;
+                    if(!expr(ctx)) tkerr(ctx, ctx->currentToken,"missing expression after , in primary expression");
                 }
             }
-            if(!consume(RPAR)) tkerr(currentToken,"missing )");
+            if(!consume(ctx, RPAR)) tkerr(ctx, ctx->currentToken,"missing )");
         }
     }
-    else if(consume(CT_INT)) {}
-    else if(consume(CT_REAL)) {}
-    else if(consume(CT_CHAR)) {}
-    else if(consume(STRING)) {}
-    else if(consume(LPAR)) {
-        if(!expr()) {
-            currentToken = startTk;
+    else if(consume(ctx, CT_INT)) {}
+    else if(consume(ctx, CT_REAL)) {}
+    else if(consume(ctx, CT_CHAR)) {}
+    else if(consume(ctx, STRING)) {}
+    else if(consume(ctx, LPAR)) {
+        if(!expr(ctx)) {
+            ctx->currentToken = startTk;
+            STAT(ctx, backtracks[BT_EXPRPRIMARY]++);
             return 0;
         }
-        if(!consume(RPAR)) tkerr(currentToken,"missing ) after expression");
+        if(!consume(ctx, RPAR)) tkerr(ctx, ctx->currentToken,"missing ) after expression");
     }
     else return 0;
     return 1;
 }
 
-int main(int argc, char **argv) {
-    
-    char *file_path = "tests/9.c";
+#ifndef COMPILER_LIBRARY
+// command line options
+typedef struct{
+    int stats;
+    int frames;                 // print the frame size of each function
+    int cache;                  // skip files whose interface file says they compile, with cachedUnit
+    int tokens;                 // print the token listing
+    int stream;                 // lex while parsing, with streamTokens
+    int pipeline;               // lex on a second thread, with pipelineUnit
+    int lexThreads;             // more than 1: lex with parallelTokens
+    int parseThreads;           // more than 1: parse with parallelUnit
+    FILE *dump;                 // binary token dump goes there
+    Trace *trace;
+} Options;
+
+// Lexes and parses one file; returns 0 when it is correct.
+static int compileFile(char *file_path, Options *opt) {
+    Context *ctx;
+    Stats stats;
+    int res;
     struct stat l_stat;
     int size;
     FILE *file;
+    double start = seconds();
 
     if(stat(file_path, &l_stat) == 0) {
         size = l_stat.st_size;
@@ -1032,26 +3380,109 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    char buffer[size*sizeof(char)];
+    // on the heap: generated sources can be far bigger than the stack
+    char *buffer = (char*)malloc(size + 1);
     int ret;
+    if(buffer == NULL || (ctx = createContext()) == NULL) {
+        printf("ERROR: Not enough memory.\n");
+        free(buffer);
+        fclose(file);
+        return -1;
+    }
     if((ret = (fread(buffer, sizeof(char), size*sizeof(char), file))) <= 0) {
         printf("ERROR: Cannot read from file.\n");
+        freeContext(ctx);
+        free(buffer);
+        fclose(file);
         return -1;
     }
-
-    if(ret < size) {
-        buffer[ret] = '\0' ;
+    buffer[ret] = '\0';
+    fclose(file);
+    ctx->text = buffer;
+    ctx->ownsText = 1;
+    ctx->path = file_path;
+    if(opt->stats) {
+        memset(&stats, 0, sizeof(stats));
+        stats.readTime = seconds() - start;
+        ctx->stats = &stats;
+    }
+    if(opt->trace) {
+        ctx->trace = opt->trace;
+        ctx->traceFile = file_path;
+        traceEvent(opt->trace, 0, "read", file_path, start, seconds());
+    }
+    if(opt->cache && !opt->tokens && !opt->dump && !opt->frames) {
+        printf("\n");
+        res = cachedUnit(ctx, buffer);
+    } else if(opt->pipeline) {
+        printf("\n");
+        res = pipelineUnit(ctx, buffer);
+        if(opt->tokens) printTokens(ctx);
+        if(opt->dump) dumpTokens(ctx, opt->dump);
     } else {
-        buffer[size] = '\0';
+        if(opt->stream) res = streamTokens(ctx, buffer);
+        else if(opt->lexThreads > 1) res = parallelTokens(ctx, buffer, opt->lexThreads);
+        else res = generateTokens(ctx, buffer);
+        printf("\n");
+        if(opt->tokens && !opt->stream) printTokens(ctx);
+        if(opt->dump && !opt->stream) dumpTokens(ctx, opt->dump);
+        if(res == RES_OK || res == RES_ERRORS) res = opt->parseThreads > 1 ? parallelUnit(ctx, opt->parseThreads) : unit(ctx);
     }
-
-    generateTokens(buffer);
-    printf("\n");
-    if (unit()) {
+    if(opt->stats) printStats(ctx);
+    if(opt->frames && res == RES_OK) printFrames(ctx);
+    if (res == RES_OK) {
         printf("Syntax is correct.\n");
+    } else {
+        printErrors(ctx);
+        if(res == RES_TOO_MANY_ERRORS) fprintf(stderr, "too many errors, stopping\n");
+        freeContext(ctx);
+        return -1;
     }
 
+    freeContext(ctx);
     return 0;
-
 }
 
+// usage: compiler [--stats] [--frames] [--cache] [--stream | --pipeline | [--lex-threads N] [--parse-threads N]] [--tokens]
+//                 [--dump-tokens out.bin] [--trace out.json] [file...]
+int main(int argc, char **argv) {
+    Options opt = {0, 0, 0, 0, 0, 0, 0, 0, NULL, NULL};
+    int i, nFiles = 0, res = 0;
+
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--stats")) opt.stats = 1;
+        else if(!strcmp(argv[i], "--frames")) opt.frames = 1;
+        else if(!strcmp(argv[i], "--cache")) opt.cache = 1;
+        else if(!strcmp(argv[i], "--tokens")) opt.tokens = 1;
+        else if(!strcmp(argv[i], "--stream")) opt.stream = 1;
+        else if(!strcmp(argv[i], "--pipeline")) opt.pipeline = 1;
+        else if(!strcmp(argv[i], "--lex-threads") && i + 1 < argc) opt.lexThreads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--parse-threads") && i + 1 < argc) opt.parseThreads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--dump-tokens") && i + 1 < argc) {
+            if((opt.dump = fopen(argv[++i], "wb")) == NULL) {
+                printf("ERROR: Cannot create %s.\n", argv[i]);
+                return -1;
+            }
+        }
+        else if(!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            if((opt.trace = openTrace(argv[++i])) == NULL) {
+                printf("ERROR: Cannot create %s.\n", argv[i]);
+                return -1;
+            }
+        }
+    }
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--frames") || !strcmp(argv[i], "--cache") || !strcmp(argv[i], "--tokens") || !strcmp(argv[i], "--stream") || !strcmp(argv[i], "--pipeline")) continue;
+        if(!strcmp(argv[i], "--trace") || !strcmp(argv[i], "--dump-tokens") || !strcmp(argv[i], "--lex-threads") || !strcmp(argv[i], "--parse-threads")) {
+            i++;
+            continue;
+        }
+        nFiles++;
+        if(compileFile(argv[i], &opt)) res = -1;
+    }
+    if(nFiles == 0) res = compileFile("tests/9.c", &opt);
+    if(opt.trace) closeTrace(opt.trace);
+    if(opt.dump) fclose(opt.dump);
+    return res;
+}
+#endif
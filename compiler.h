@@ -0,0 +1,265 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <setjmp.h>
+#include <stdio.h>
+
+#define MAX_ERRORS 50
+#define MAX_ERROR_LEN 256
+#define MAX_THREADS 64                  // chunks of parallelTokens, workers of parallelUnit
+
+enum { ID, END, CT_INT, CT_REAL, STRING, ADD, SUB, MUL, DIV,
+    SEMICOLON, COMMA, LPAR, RPAR, LBRACKET, RBRACKET, LACC, RACC,
+    DOT, AND, OR, NOT, NEQUAL, EQUAL, ASSIGN, LESS, LESSEQ,
+    GREATER, GREATEREQ, BREAK, CHAR, DOUBLE, ELSE, FOR, IF, INT,
+    RETURN, STRUCT, VOID, WHILE, CT_CHAR };
+
+typedef struct _Token{
+    int code;
+    union {
+        char *text;
+        long int i;
+        double r;
+    };
+    int offset, length;         // of its text, in Context.text
+    int line;                   // counted from 1, as in the error messages
+    struct _Token *next;
+} Token;
+
+typedef struct _Symbol Symbol;
+typedef struct{
+    Symbol **begin;
+    Symbol **end;
+    Symbol **after;
+} Symbols;
+
+enum{TB_INT,TB_DOUBLE,TB_CHAR,TB_STRUCT,TB_VOID};
+typedef struct{
+    int typeBase;
+    Symbol *s;
+    int nElements;
+}Type;
+
+enum{CLS_VAR,CLS_FUNC,CLS_EXTFUNC,CLS_STRUCT};
+enum{MEM_GLOBAL,MEM_ARG,MEM_LOCAL};
+typedef struct _Symbol{
+    const char *name;               // owned by the symbol
+    unsigned hash;                  // hashName(name)
+    int cls;
+    int mem;
+    Type type;
+    int depth;
+    union{
+        Symbols args;
+        Symbols members;
+    };
+    int offset;             // CLS_VAR inside a struct: byte offset of the member
+                            // MEM_ARG, MEM_LOCAL: byte offset in the frame of its function
+    int size;               // CLS_STRUCT: total size in bytes, including padding
+                            // CLS_FUNC: frame size, arguments and locals, with locals of
+                            // blocks that are not open at the same time sharing bytes
+    int align;              // CLS_STRUCT: alignment of the whole struct; CLS_FUNC: of its frame
+    Symbol **index;         // CLS_STRUCT: open addressing hash of members, by name
+    int indexSize;          // CLS_STRUCT: number of slots in index (power of 2)
+    int imported;           // added by an import, not declared in this file
+} Symbol;
+
+typedef struct{
+    int offset, length;             // of the text an error is about; offset is -1 when there is none
+} Span;
+
+// places where the parser goes back to an earlier token, counted in Stats.backtracks
+enum{BT_DECLSTRUCT,BT_DECLFUNC,BT_EXPRASSIGN,BT_EXPRCAST,BT_EXPRPRIMARY,BT_N};
+
+// Filled in while Context.stats points to it.
+typedef struct{
+    double readTime, lexTime, parseTime;    // seconds; readTime is up to the caller
+    long tokens[CT_CHAR + 1];               // produced, by code
+    long backtracks[BT_N];
+    int depth, maxDepth;                    // nesting of statements and expressions
+    long allocs, allocBytes;
+    double lexWait, parseWait;              // pipelineUnit: seconds each thread waited for the other
+    int chunks, chunksRelexed;              // parallelTokens: chunks lexed in parallel, and again afterwards
+    int bodies, fallbacks;                  // parallelUnit: bodies parsed in parallel, times it ran unit() instead
+    int imports, importsCompiled;           // interfaces loaded, and how many of them had to be compiled first
+    int nWorkers;                           // parallelUnit: threads of its last run, and for each of them
+    int workerJobs[MAX_THREADS];            //     the bodies it took
+    double workerBusy[MAX_THREADS];         //     and the seconds it spent on them,
+    double workerWall;                      //     out of this many for the whole run
+} Stats;
+
+// Chrome trace-event file (JSON array format), for chrome://tracing or Perfetto.
+// Events from several threads may go to the same trace.
+typedef struct{
+    FILE *out;
+    double start;                   // seconds() when opened; timestamps count from there
+    int nEvents;
+} Trace;
+
+// One iteration of unit(): a declaration, or the tokens skipped after an error at top level.
+typedef struct{
+    Token *first;
+    Symbol *func;                   // complete function, whose body can be parsed again on its own
+    Token *body, *end;              // func: LACC and RACC of its body
+    int symbolsEnd;                 // number of entries in Context.symbols after this declaration
+    char (*errors)[MAX_ERROR_LEN];  // errors found in this declaration
+    Span *spans;                    // their spans, with offsets from first->offset
+    int nErrors;
+} Decl;
+
+// Text of the ID and STRING tokens, escapes decoded, each distinct string stored once.
+// The strings live in blocks that are freed only with the context, so tokens just point
+// into them; slots is an open addressing hash of them, by contents.
+typedef struct _StringBlock StringBlock;
+typedef struct _StringSlot StringSlot;
+typedef struct{
+    StringBlock *blocks;            // newest first; strings are added to the first one
+    StringSlot *slots;
+    int nSlots, nStrings;           // nSlots is 0 or a power of 2
+} Strings;
+
+// A file an import read, directly or through the interface of another file.
+typedef struct{
+    char *path;                     // as realpath gives it
+    unsigned long long hash;        // hashBytes of its contents then
+} Import;
+
+typedef struct _Pipe Pipe;
+
+// Trace events of the lexer thread of pipelineUnit use Context.traceTid + PIPE_TID,
+// those of chunk i of parallelTokens and of worker i of parallelUnit Context.traceTid + PIPE_TID + i.
+#define PIPE_TID 1000
+
+// Context.changed, when it is not the index of a declaration
+enum{CHANGED_NONE=-2,CHANGED_ALL=-1};
+
+// Everything one compilation needs. Contexts share nothing, so separate
+// contexts can be used from separate threads.
+typedef struct _Context{
+    char *text;                     // source of the tokens; owned when ownsText is set
+    int ownsText;
+    const char *path;               // file the text comes from, if any: imports are relative to it
+    Token *tokens, *lastToken;      // list built by generateTokens
+    Strings strings;                // their text
+    Token *currentToken, *consumedTk;
+    int line;                       // lexer: current line, counted from 0 (its index in lineStarts);
+                                    // afterwards: that of the last line
+    int *lineStarts;                // offset of each line, filled in by the lexer
+    int maxLines;
+    Token *relexOld;                // relexEdit: next old token the new ones may line up with
+    int relexDelta, relexFrom;      // relexEdit: size change of the text, end of the inserted text
+    Span *relexErrors;              // relexEdit: spans of the old lexical errors from where it restarts
+    int nRelexErrors, relexError;   //     on, and the first one not before relexOld
+    Token *fixFrom;                 // first token whose offset and line still need fixTokens
+    int fixOffset, fixLine;
+    int streaming;                  // set by streamTokens
+    int cached;                     // set when cachedUnit found the result in the interface file
+    char *lexPos;                   // streaming: where the lexer goes on; NULL once it added END
+    Pipe *pipe;                     // set while pipelineUnit parses
+    char *lexEnd;                   // parallelTokens chunk: the lexer stops at the first token starting
+                                    // there or later, and leaves where it stopped here
+    int linesKnown;                 // parallelTokens chunk: lineStarts is filled in already
+    Decl *decls;                    // found by the last unit()
+    int nDecls, maxDecls;
+    int changed;                    // what relexEdit changed since then: CHANGED_NONE, CHANGED_ALL
+                                    // or the index of the only declaration whose body changed
+    Token *declFirst;               // unit(): first token and error of the declaration being parsed
+    int declErrors;
+    Token *unaryFrom, *unaryTo;     // last exprUnary: its first token and the one after it (NULL: no match)
+    Symbols symbols;
+    Symbols outer;                  // parallelUnit worker: symbols of the declarations before the body
+                                    // being parsed, searched after symbols; empty otherwise
+    int skipBodies;                 // parallelUnit: the first pass steps over function bodies
+    int crtDepth;
+    Symbol *crtFunc, *crtStruct;
+    int frameTop;                   // crtFunc: end of the arguments and locals in scope in its frame
+    char errors[MAX_ERRORS][MAX_ERROR_LEN];
+    Span errorSpans[MAX_ERRORS];
+    int nErrors;
+    int nLexErrors;                 // errors[0..nLexErrors) come from the lexer
+    jmp_buf *recoverPoint;          // innermost parser rule that can resync after an error
+    jmp_buf fatal;                  // taken by err() and when the error buffer fills up
+    Stats *stats;                   // NULL when no statistics are wanted
+    Trace *trace;                   // NULL when no trace is wanted
+    int traceTid;                   // thread id in the trace events
+    const char *traceFile;          // file name in the trace events
+    double declStart;               // unit(): when the declaration being parsed started
+    Import *imports;                // files the imports of the last unit() depend on
+    int nImports, maxImports;
+    struct _Context *importer;      // compiling an imported file: the context that imports it
+} Context;
+
+// results of generateTokens, relexEdit and unit
+// after RES_TOO_MANY_ERRORS or RES_FATAL the context can only be freed
+enum{RES_OK,RES_ERRORS,RES_TOO_MANY_ERRORS,RES_FATAL,RES_INVALID};
+
+Context *createContext();
+void freeContext(Context *ctx);
+int generateTokens(Context *ctx, char *input);
+// Like generateTokens, but lexes only the first few tokens. unit() then lexes the rest
+// as it needs them and frees the tokens of each declaration once it is parsed, so memory
+// grows with the largest declaration instead of the file. Errors come in the order they
+// are found. relexEdit (which returns RES_INVALID), incremental parsing and the token
+// listings do not apply to such a context.
+int streamTokens(Context *ctx, char *input);
+// Like generateTokens, but splits the text at line breaks into up to nThreads chunks and
+// lexes them on separate threads, each as if it started outside any comment, string or
+// character constant. A chunk where that was wrong is lexed again from where the one
+// before it really ended. Tokens, lines and errors are the same as with generateTokens.
+int parallelTokens(Context *ctx, char *input, int nThreads);
+// Applies an edit to the text and relexes only the part it affects. The lexical errors
+// afterwards are those generateTokens would report for the new text.
+int relexEdit(Context *ctx, int offset, int deleted, const char *inserted);
+// Brings token offsets and lines up to date after relexEdit; unit and printTokens
+// do it themselves.
+void fixTokens(Context *ctx);
+// generateTokens followed by unit, with the lexer on a second thread that hands the parser
+// batches of tokens as it goes. The result and the context afterwards are the same as
+// with the two calls; Stats.lexWait and parseWait tell how long each side stalled.
+int pipelineUnit(Context *ctx, char *input);
+// Parses the tokens. After relexEdit changed only the body of one function, only that
+// body is parsed again and the symbols and errors of the other declarations are kept.
+// import "file"; declarations add the structs and functions of that file, through its
+// interface file (see compiler.c), and list what they read in ctx->imports.
+int unit(Context *ctx);
+// Like unit, but parses the function bodies on nThreads threads. A first pass goes over the
+// declarations in order and steps over each body to its matching brace, which defines every
+// struct, global and function first. The bodies are then parsed in any order, each seeing
+// only the symbols declared before it, and their errors are put back in declaration order.
+// The result is the same as unit's; when a body does not end at its matching brace,
+// unit itself is run instead.
+int parallelUnit(Context *ctx, int nThreads);
+// generateTokens followed by unit, with the interface file of ctx->path as a cache of the
+// result. When that file was written for the same text and none of the files it imports
+// changed since, the text compiled without errors: cachedUnit adds the structs and functions
+// it declares, as an import of it would (ctx->imports included), and returns RES_OK without
+// lexing or parsing it. Otherwise it compiles the text and, when that returns RES_OK, writes
+// the interface file for the next run. There are no tokens, declarations or global variables
+// after a hit, so relexEdit, unit, parallelUnit and pipelineUnit return RES_INVALID for the
+// context, as relexEdit does for a streaming one.
+int cachedUnit(Context *ctx, char *input);
+// Token listing on stdout
+void printTokens(Context *ctx);
+// Binary dump of the tokens, described above dumpTokens in compiler.c
+void dumpTokens(Context *ctx, FILE *out);
+// Prints the errors, each followed by its source line with the span underlined.
+void printErrors(Context *ctx);
+void printStats(Context *ctx);
+// Frame size of each function on stdout: its arguments, then its locals, where those of blocks
+// that are never open together share bytes. The offset of each one is in its Symbol.
+// The layouts are complete only when unit returned RES_OK.
+void printFrames(Context *ctx);
+// monotonic clock, in seconds
+double seconds();
+Trace *openTrace(const char *path);
+void closeTrace(Trace *trace);
+// Adds a complete event ("ph":"X") spanning start..end, both from seconds().
+void traceEvent(Trace *trace, int tid, const char *name, const char *file, double start, double end);
+// Line and column (from 1) of an offset in ctx->text, looked up in the line-start index.
+void findPosition(Context *ctx, int offset, int *line, int *column);
+// The whole file, NUL terminated, in a malloc'ed buffer; NULL when it cannot be read.
+char *readFile(const char *path, long *size);
+// FNV-1a, 64 bits
+unsigned long long hashBytes(const char *p, long n);
+
+#endif
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Fuzzing entry points for both lexers and the parser, in the libFuzzer style:
+// each call runs one input in-process and returns, whatever the input.
+//
+// With libFuzzer (clang), one target per binary:
+//     clang -g -O1 -fsanitize=fuzzer,address -DCOMPILER_LIBRARY fuzz.c compiler.c -o fuzz_unit
+//     clang -g -O1 -fsanitize=fuzzer,address -DCOMPILER_LIBRARY -DFUZZ_TARGET=fuzzTokens fuzz.c compiler.c -o fuzz_tokens
+//     clang -g -O1 -fsanitize=fuzzer,address -DLEXER_LIBRARY -DFUZZ_LEXER fuzz.c lexicalAnalysis.c -o fuzz_lexer
+//     mkdir -p corpus && cp tests/*.c corpus/ && ./fuzz_unit corpus
+//
+// Without libFuzzer, FUZZ_DRIVER adds a main that mutates the seed files (tests/0.c..9.c
+// when none are given) for some seconds and reports execs/sec:
+//     gcc -g -O1 -fsanitize=address -DCOMPILER_LIBRARY -DFUZZ_DRIVER fuzz.c compiler.c -o fuzz_unit
+//     ./fuzz_unit [-seconds N] [-seed N] [file...]
+// When an input crashes it is written to crash-input first.
+
+#ifdef FUZZ_LEXER
+
+// lexicalAnalysis.c
+int getNextToken();
+void resetLexer(char *text);
+extern jmp_buf *stopPoint;
+enum{LEXER_END = 0};
+
+#ifndef FUZZ_TARGET
+#define FUZZ_TARGET fuzzGetNextToken
+#endif
+
+// getNextToken until END
+int fuzzGetNextToken(const uint8_t *data, size_t size) {
+    char *text;
+    jmp_buf stop;
+    if((text = (char*)malloc(size + 1)) == NULL) return 0;
+    memcpy(text, data, size);
+    text[size] = '\0';
+    resetLexer(text);
+    stopPoint = &stop;
+    if(!setjmp(stop)) {
+        while(getNextToken() != LEXER_END);
+    }
+    stopPoint = NULL;
+    resetLexer(NULL);
+    free(text);
+    return 0;
+}
+
+#else
+
+#include "compiler.h"
+
+#ifndef FUZZ_TARGET
+#define FUZZ_TARGET fuzzUnit
+#endif
+
+enum{FUZZ_TOKENS,FUZZ_UNIT,FUZZ_STREAM,FUZZ_PIPELINE,FUZZ_PARALLEL,FUZZ_PARALLEL_UNIT,FUZZ_EDIT,FUZZ_CACHED};
+
+#define FUZZ_EDITS 8                    // FUZZ_EDIT: edits made to each input
+
+// Whether ctx and seq have the same errors.
+int sameErrors(Context *ctx, Context *seq) {
+    int i;
+    if(ctx->nErrors != seq->nErrors || ctx->nLexErrors != seq->nLexErrors) return 0;
+    for(i = 0; i < ctx->nErrors; i++) {
+        if(strcmp(ctx->errors[i], seq->errors[i])) return 0;
+        if(ctx->errorSpans[i].offset != seq->errorSpans[i].offset || ctx->errorSpans[i].length != seq->errorSpans[i].length) return 0;
+    }
+    return 1;
+}
+
+// Whether ctx and seq have the same tokens, with the same values, and the same line index.
+int sameTokens(Context *ctx, Context *seq) {
+    Token *a, *b;
+    fixTokens(ctx);
+    if(ctx->line != seq->line || memcmp(ctx->lineStarts, seq->lineStarts, (ctx->line + 1) * sizeof(int))) return 0;
+    for(a = ctx->tokens, b = seq->tokens; a && b; a = a->next, b = b->next) {
+        if(a->code != b->code || a->offset != b->offset || a->length != b->length || a->line != b->line) return 0;
+        if((a->code == ID || a->code == STRING) && strcmp(a->text, b->text)) return 0;
+        if((a->code == CT_INT || a->code == CT_CHAR) && a->i != b->i) return 0;
+        if(a->code == CT_REAL && memcmp(&a->r, &b->r, sizeof(double))) return 0;
+    }
+    return a == NULL && b == NULL && ctx->lastToken->code == END;
+}
+
+// FUZZ_EDIT: makes FUZZ_EDITS edits to the text of ctx, which unit() has parsed, at places and
+// with text picked by a hash of it. After each one relexEdit and unit must give the same
+// tokens, lines, errors and results as generateTokens and unit on the new text.
+void fuzzEdits(Context *ctx) {
+    static const char *pieces[] = {"", " ", "\n", "x", "int ", "1", "2.5", ";", "{", "}", "(", ")", "if",
+                                   "+", "0x1F", "\"", "'", "/*", "*/", "//", "\\", "@", "while(1){"};
+    Context *seq;
+    unsigned long long h = hashBytes(ctx->text, strlen(ctx->text)) | 1;
+    char *text, piece[16];
+    const char *inserted;
+    int k, len, offset, deleted, res, seqRes;
+    for(k = 0; k < FUZZ_EDITS; k++) {
+        h ^= h << 13;
+        h ^= h >> 7;
+        h ^= h << 17;
+        len = strlen(ctx->text);
+        offset = len ? (h >> 8) % (len + 1) : 0;
+        deleted = (h >> 40) % 5;
+        if(deleted > len - offset) deleted = len - offset;
+        inserted = pieces[(h >> 48) % (sizeof(pieces) / sizeof(pieces[0]))];
+        if((h >> 60) == 0 && len) {                     // a piece of the text itself
+            snprintf(piece, sizeof(piece), "%s", ctx->text + (h >> 24) % len);
+            inserted = piece;
+        }
+        res = relexEdit(ctx, offset, deleted, inserted);
+        if((seq = createContext()) == NULL) return;
+        if((text = strdup(ctx->text)) == NULL) {
+            freeContext(seq);
+            return;
+        }
+        seqRes = generateTokens(seq, text);
+        if(res != seqRes || !sameErrors(ctx, seq)) abort();
+        if(res == RES_OK || res == RES_ERRORS) {
+            if(!sameTokens(ctx, seq)) abort();
+            res = unit(ctx);
+            if(res != unit(seq) || !sameErrors(ctx, seq)) abort();
+        }
+        freeContext(seq);
+        free(text);
+        if(res != RES_OK && res != RES_ERRORS) return;
+    }
+}
+
+// Runs the front end on a NUL terminated copy of data: only the lexer with FUZZ_TOKENS,
+// the lexer and then unit() with FUZZ_UNIT, both interleaved with FUZZ_STREAM.
+// FUZZ_PIPELINE runs pipelineUnit and aborts when its result differs from FUZZ_UNIT's,
+// FUZZ_PARALLEL parallelTokens when its tokens, lines or errors differ from FUZZ_TOKENS',
+// FUZZ_PARALLEL_UNIT parallelUnit when its result, errors, declarations or symbols differ from unit's,
+// FUZZ_EDIT relexEdit and unit after a few edits when they differ from lexing and parsing anew,
+// FUZZ_CACHED cachedUnit twice, when the second run misses an input the first one compiled or
+// an edit or a parse of the hit does not return RES_INVALID.
+int fuzzCompile(const uint8_t *data, size_t size, int how) {
+    Context *ctx, *seq;
+    char *text, path[64], name[64];
+    int res, i;
+    if((text = (char*)malloc(size + 1)) == NULL) return 0;
+    memcpy(text, data, size);
+    text[size] = '\0';
+    if(how == FUZZ_PARALLEL_UNIT) {
+        if((ctx = createContext()) != NULL && (seq = createContext()) != NULL) {
+            res = generateTokens(ctx, text);
+            if(generateTokens(seq, text) == res && (res == RES_OK || res == RES_ERRORS)) {
+                res = parallelUnit(ctx, 4);
+                if(res != unit(seq) || ctx->nErrors != seq->nErrors) abort();
+                for(i = 0; i < ctx->nErrors; i++) {
+                    if(strcmp(ctx->errors[i], seq->errors[i])) abort();
+                }
+                if(res == RES_OK || res == RES_ERRORS) {
+                    if(ctx->nDecls != seq->nDecls || ctx->symbols.end - ctx->symbols.begin != seq->symbols.end - seq->symbols.begin) abort();
+                    for(i = 0; i < ctx->nDecls; i++) {
+                        if(ctx->decls[i].nErrors != seq->decls[i].nErrors || ctx->decls[i].symbolsEnd != seq->decls[i].symbolsEnd) abort();
+                    }
+                    for(i = 0; ctx->symbols.begin + i != ctx->symbols.end; i++) {
+                        if(strcmp(ctx->symbols.begin[i]->name, seq->symbols.begin[i]->name)) abort();
+                    }
+                }
+            }
+            freeContext(seq);
+        }
+        if(ctx) freeContext(ctx);
+    } else if(how == FUZZ_PIPELINE) {
+        if((ctx = createContext()) != NULL && (seq = createContext()) != NULL) {
+            res = pipelineUnit(ctx, text);
+            i = generateTokens(seq, text);
+            if(i == RES_OK || i == RES_ERRORS) i = unit(seq);
+            if(res != i || ctx->nErrors != seq->nErrors || ctx->nLexErrors != seq->nLexErrors) abort();
+            for(i = 0; i < ctx->nErrors; i++) {
+                if(strcmp(ctx->errors[i], seq->errors[i])) abort();
+            }
+            freeContext(seq);
+        }
+        if(ctx) freeContext(ctx);
+    } else if(how == FUZZ_PARALLEL) {
+        if((ctx = createContext()) != NULL && (seq = createContext()) != NULL) {
+            res = parallelTokens(ctx, text, 4);
+            if(res != generateTokens(seq, text) || !sameErrors(ctx, seq)) abort();
+            if((res == RES_OK || res == RES_ERRORS) && !sameTokens(ctx, seq)) abort();
+            freeContext(seq);
+        }
+        if(ctx) freeContext(ctx);
+    } else if(how == FUZZ_EDIT) {
+        if((ctx = createContext()) != NULL) {
+            res = generateTokens(ctx, text);
+            if(res == RES_OK || res == RES_ERRORS) res = unit(ctx);
+            if(res == RES_OK || res == RES_ERRORS) fuzzEdits(ctx);
+            freeContext(ctx);
+        }
+    } else if(how == FUZZ_CACHED) {
+        snprintf(path, sizeof(path), "/tmp/fuzz-cached-%d.c", (int)getpid());
+        snprintf(name, sizeof(name), "%s.aif", path);
+        unlink(name);
+        if((ctx = createContext()) != NULL) {
+            ctx->path = path;
+            res = cachedUnit(ctx, text);
+            freeContext(ctx);
+            if(res == RES_OK && (ctx = createContext()) != NULL) {
+                ctx->path = path;
+                if(cachedUnit(ctx, text) != RES_OK || !ctx->cached) abort();
+                if(relexEdit(ctx, 0, 0, " ") != RES_INVALID || unit(ctx) != RES_INVALID) abort();
+                if(parallelUnit(ctx, 4) != RES_INVALID || pipelineUnit(ctx, text) != RES_INVALID) abort();
+                freeContext(ctx);
+            }
+        }
+        unlink(name);
+    } else if((ctx = createContext()) != NULL) {
+        res = how == FUZZ_STREAM ? streamTokens(ctx, text) : generateTokens(ctx, text);
+        if(how != FUZZ_TOKENS && (res == RES_OK || res == RES_ERRORS)) unit(ctx);
+        freeContext(ctx);
+    }
+    free(text);
+    return 0;
+}
+
+int fuzzTokens(const uint8_t *data, size_t size) {
+    return fuzzCompile(data, size, FUZZ_TOKENS);
+}
+
+int fuzzUnit(const uint8_t *data, size_t size) {
+    return fuzzCompile(data, size, FUZZ_UNIT);
+}
+
+int fuzzStream(const uint8_t *data, size_t size) {
+    return fuzzCompile(data, size, FUZZ_STREAM);
+}
+
+int fuzzPipeline(const uint8_t *data, size_t size) {
+    return fuzzCompile(data, size, FUZZ_PIPELINE);
+}
+
+int fuzzParallelUnit(const uint8_t *data, size_t size) {
+    return fuzzCompile(data, size, FUZZ_PARALLEL_UNIT);
+}
+
+int fuzzEdit(const uint8_t *data, size_t size) {
+    return fuzzCompile(data, size, FUZZ_EDIT);
+}
+
+int fuzzCached(const uint8_t *data, size_t size) {
+    return fuzzCompile(data, size, FUZZ_CACHED);
+}
+
+// build with a small -DLEX_CHUNK, such as 16, so the inputs get split at all
+int fuzzParallel(const uint8_t *data, size_t size) {
+    return fuzzCompile(data, size, FUZZ_PARALLEL);
+}
+
+#endif
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    return FUZZ_TARGET(data, size);
+}
+
+#ifdef FUZZ_DRIVER
+
+#define MAX_SEEDS 256
+#define MAX_INPUT 65536
+
+typedef struct{
+    char *data;
+    int size;
+} Input;
+
+Input seeds[MAX_SEEDS];
+int nSeeds;
+char input[MAX_INPUT];          // the one being run, saved when it crashes
+int inputSize;
+unsigned long long rng;
+
+// __sanitizer_set_death_callback, when the program is built with a sanitizer
+void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+void saveInput() {
+    int fd = open("crash-input", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return;
+    if(write(fd, input, inputSize) < 0) {}
+    close(fd);
+}
+
+void onCrash(int sig) {
+    saveInput();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// xorshift64
+unsigned random32() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (unsigned)(rng >> 32);
+}
+
+int addSeed(const char *path) {
+    FILE *file;
+    long size;
+    if(nSeeds == MAX_SEEDS || (file = fopen(path, "rb")) == NULL) return -1;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(size < 0 || size > MAX_INPUT / 2 || (seeds[nSeeds].data = (char*)malloc(size + 1)) == NULL) {
+        fclose(file);
+        return -1;
+    }
+    seeds[nSeeds].size = fread(seeds[nSeeds].data, 1, size, file);
+    fclose(file);
+    nSeeds++;
+    return 0;
+}
+
+// Replaces input with a seed changed in a few places, favouring characters the lexer cares about.
+void mutate() {
+    static const char interesting[] = "\"'\\/*\n\r\t {}()[];,.&|!=<>+-0123456789eExX_abfnrtv?";
+    Input *seed = &seeds[random32() % nSeeds], *other;
+    int n = 1 + random32() % 8, at, len;
+    memcpy(input, seed->data, seed->size);
+    inputSize = seed->size;
+    while(n--) {
+        at = inputSize ? random32() % inputSize : 0;
+        len = 1 + random32() % 16;
+        switch(random32() % 6) {
+            case 0:             // overwrite a byte
+                if(inputSize) input[at] = random32() % 4 ? interesting[random32() % (sizeof(interesting) - 1)] : (char)random32();
+                break;
+            case 1:             // insert a byte
+                if(inputSize < MAX_INPUT) {
+                    memmove(input + at + 1, input + at, inputSize - at);
+                    input[at] = interesting[random32() % (sizeof(interesting) - 1)];
+                    inputSize++;
+                }
+                break;
+            case 2:             // delete some bytes
+                if(at + len > inputSize) len = inputSize - at;
+                memmove(input + at, input + at + len, inputSize - at - len);
+                inputSize -= len;
+                break;
+            case 3:             // cut the end off
+                inputSize = at;
+                break;
+            case 4:             // copy a piece of another seed in
+                other = &seeds[random32() % nSeeds];
+                if(other->size == 0) break;
+                if(len > other->size) len = other->size;
+                if(inputSize + len > MAX_INPUT) break;
+                memmove(input + at + len, input + at, inputSize - at);
+                memcpy(input + at, other->data + random32() % (other->size - len + 1), len);
+                inputSize += len;
+                break;
+            case 5:             // repeat a piece, for deep nesting and long tokens
+                if(at + len > inputSize) len = inputSize - at;
+                while(len > 0 && inputSize + len <= MAX_INPUT && random32() % 8) {
+                    memmove(input + at + len, input + at, inputSize - at);
+                    inputSize += len;
+                }
+                break;
+        }
+    }
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// usage: fuzz [-seconds N] [-seed N] [file...]
+int main(int argc, char **argv) {
+    static const char *defaultSeeds[] = {"tests/0.c", "tests/1.c", "tests/2.c", "tests/3.c", "tests/4.c",
+                                         "tests/5.c", "tests/6.c", "tests/7.c", "tests/8.c", "tests/9.c"};
+    double seconds = 10, start, elapsed;
+    long execs = 0;
+    int i;
+
+    rng = (unsigned long long)time(NULL);
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-seconds") && i + 1 < argc) seconds = atof(argv[++i]);
+        else if(!strcmp(argv[i], "-seed") && i + 1 < argc) rng = strtoull(argv[++i], NULL, 0);
+        else if(addSeed(argv[i])) fprintf(stderr, "cannot read %s\n", argv[i]);
+    }
+    if(nSeeds == 0) {
+        for(i = 0; i < 10; i++) {
+            if(addSeed(defaultSeeds[i])) fprintf(stderr, "cannot read %s\n", defaultSeeds[i]);
+        }
+    }
+    if(nSeeds == 0) return -1;
+    if(rng == 0) rng = 1;
+    printf("seed %llu, %d seed files\n", rng, nSeeds);
+
+    signal(SIGSEGV, onCrash);
+    signal(SIGBUS, onCrash);
+    signal(SIGABRT, onCrash);
+    if(__sanitizer_set_death_callback) __sanitizer_set_death_callback(saveInput);
+
+    // the seeds as they are, then mutations of them
+    start = now();
+    for(i = 0; i < nSeeds; i++, execs++) {
+        memcpy(input, seeds[i].data, seeds[i].size);
+        inputSize = seeds[i].size;
+        LLVMFuzzerTestOneInput((const uint8_t*)input, inputSize);
+    }
+    do {
+        for(i = 0; i < 256; i++, execs++) {
+            mutate();
+            LLVMFuzzerTestOneInput((const uint8_t*)input, inputSize);
+        }
+    } while((elapsed = now() - start) < seconds);
+    printf("%ld execs in %.1f s: %.0f execs/sec\n", execs, elapsed, execs / elapsed);
+    return 0;
+}
+
+#endif
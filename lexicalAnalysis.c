@@ -7,8 +7,14 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <setjmp.h>
+#include <limits.h>
+#include <math.h>
 
 #define MAX 10001
+#define OUT_SIZE 65536
+#define MAX_ERRORS 50
+#define MAX_ERROR_LEN 256
 #define SAFEALLOC(var,Type) if((var=(Type*)malloc(sizeof(Type)))==NULL)err("not enough memory");
 
 typedef enum { END = 0, ID, CT_INT, CT_REAL, CT_CHAR, CT_STRING,
@@ -20,10 +26,33 @@ typedef enum { END = 0, ID, CT_INT, CT_REAL, CT_CHAR, CT_STRING,
 int getNextToken();
 int line = 1;
 char *pCrtCh;
+char errors[MAX_ERRORS][MAX_ERROR_LEN];
+int nErrors = 0;
+jmp_buf *stopPoint = NULL;	// when set, errors that would end the program jump there instead
+
+void printErrors()
+	{
+		int i;
+		for(i = 0; i < nErrors; i++) fputs(errors[i], stderr);
+	}
+
+// records a lexical error; the caller picks the state to continue from
+void lexError(const char *msg)
+	{
+		snprintf(errors[nErrors], MAX_ERROR_LEN, "error in line %d: %s\n", line, msg);
+		if(++nErrors == MAX_ERRORS)
+		{
+			if(stopPoint) longjmp(*stopPoint, 1);
+			printErrors();
+			fprintf(stderr, "too many errors, stopping\n");
+			exit(-1);
+		}
+	}
 
 void err(const char *fmt, ...)
 	{
 		va_list va;
+		if(stopPoint) longjmp(*stopPoint, 1);
 		va_start(va,fmt);
 		fprintf(stderr,"error: ");
 		vfprintf(stderr,fmt,va);
@@ -35,7 +64,7 @@ void err(const char *fmt, ...)
 typedef struct _Token{
 	int code;                      
 	union {
-		char *text;                 // used for ID, CT_STRING (dynamic allocation)
+		char *text;                 // used for ID, CT_STRING (in the string pool)
 		long int i;                 // used for CT_INT, CT_CHAR
 		double r;                   // used for CT_REAL
 		};
@@ -45,6 +74,26 @@ typedef struct _Token{
 
 Token *lastToken = NULL, *firstToken = NULL;
 
+#define STRING_BLOCK 65536
+
+// String pool: the texts of ID and CT_STRING tokens, each distinct one stored once, in
+// blocks that are freed by resetLexer; the tokens only point into them
+typedef struct _StringBlock{
+	struct _StringBlock *next;
+	int size, used;                     // bytes of data, and how many of them hold strings
+	char data[];
+	} StringBlock;
+
+typedef struct{
+	char *s;                            // NULL for a free slot
+	unsigned hash;
+	int length;
+	} StringSlot;
+
+StringBlock *stringBlocks = NULL;       // newest first; strings are added to the first one
+StringSlot *stringSlots = NULL;         // open addressing hash of the strings, by contents
+int nStringSlots = 0, nStrings = 0;
+
 Token *addTk(int code)
 {
 	Token *tk;
@@ -63,6 +112,41 @@ Token *addTk(int code)
 	return tk;
 }
 
+void freeTokens()
+{
+	Token *tk, *next;
+	for(tk = firstToken; tk != NULL; tk = next)
+	{
+		next = tk->next;
+		free(tk);
+	}
+	firstToken = lastToken = NULL;
+}
+
+void freeStrings()
+{
+	StringBlock *b, *next;
+	for(b = stringBlocks; b != NULL; b = next)
+	{
+		next = b->next;
+		free(b);
+	}
+	free(stringSlots);
+	stringBlocks = NULL;
+	stringSlots = NULL;
+	nStringSlots = nStrings = 0;
+}
+
+// frees the token list and the string pool and gets ready to lex text from its first line
+void resetLexer(char *text)
+{
+	freeTokens();
+	freeStrings();
+	line = 1;
+	nErrors = 0;
+	pCrtCh = text;
+}
+
 char *getTokenCode(int code)
 {
 	switch(code)
@@ -113,34 +197,164 @@ char *getTokenCode(int code)
 	}
 }
 
+// output buffer for the token listing and dump, written out in OUT_SIZE chunks
+char outBuf[OUT_SIZE];
+int outLen = 0;
+FILE *outFile;
+
+void outFlush()
+{
+	fwrite(outBuf, 1, outLen, outFile);
+	outLen = 0;
+}
+
+void outBytes(const char *p, int n)
+{
+	if(outLen + n > OUT_SIZE) outFlush();
+	if(n > OUT_SIZE)
+	{
+		fwrite(p, 1, n, outFile);
+		return;
+	}
+	memcpy(outBuf + outLen, p, n);
+	outLen += n;
+}
+
+void outStr(const char *s)
+{
+	outBytes(s, strlen(s));
+}
+
+void outLong(long v)
+{
+	char digits[24];
+	int n = sizeof(digits);
+	unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+	do
+	{
+		digits[--n] = '0' + u % 10;
+		u /= 10;
+	}while(u);
+	if(v < 0) digits[--n] = '-';
+	outBytes(digits + n, sizeof(digits) - n);
+}
+
+// same text as printf("%g")
+void outReal(double r)
+{
+	char digits[32];
+	// whole numbers below 1e6 have no exponent and no fraction with %g; -0.0 keeps its sign
+	if(r > -1e6 && r < 1e6 && r == (long)r && (r != 0 || 1 / r > 0))
+	{
+		outLong((long)r);
+		return;
+	}
+	outBytes(digits, snprintf(digits, sizeof(digits), "%g", r));
+}
+
+void outU32(unsigned long v)
+{
+	char b[4];
+	int i;
+	for(i = 0; i < 4; i++) b[i] = (char)(v >> (8 * i));
+	outBytes(b, 4);
+}
+
+void outU64(unsigned long long v)
+{
+	char b[8];
+	int i;
+	for(i = 0; i < 8; i++) b[i] = (char)(v >> (8 * i));
+	outBytes(b, 8);
+}
+
+// writes one line of the listing to the output buffer
+void displayToken(Token *currentToken)
+{
+	char c;
+	outStr(" ");
+	outLong(currentToken->line);
+	outStr(" ");
+	outStr(getTokenCode((currentToken->code)));
+	outStr(" ");
+	switch(currentToken->code)
+	{
+		case ID: outStr(" :  ");
+			 outStr(currentToken->text);
+		         break;
+		case CT_INT: outStr(" :  ");
+			     outLong(currentToken->i);
+			     break;
+		case CT_CHAR: outStr(" :  ");
+			      c = (char)currentToken->i;
+			      outBytes(&c, 1);
+			      break;
+		case CT_REAL: outStr(" :  ");
+			      outReal(currentToken->r);
+			      break;
+		case CT_STRING:	outStr(" :  ");
+				outStr(currentToken->text);
+				break;
+
+		default : break;
+	}
+	outStr("\n");
+}
+
 void displayTokens()
 {
 	Token *currentToken;
+	outFile = stdout;
+	for(currentToken = firstToken; currentToken != NULL; currentToken = currentToken->next) displayToken(currentToken);
+	outFlush();
+}
+
+// Binary dump in the format of dumpTokens in compiler.c, with this lexer's codes and names.
+// Offsets and lengths are not kept here, so both are written as 0.
+void dumpTokens(FILE *out)
+{
+	Token *currentToken;
+	unsigned long long bits;
+	int code, n;
+	char c;
+	outFile = out;
+	outStr("ATKD");
+	outBytes("\1", 1);
+	c = WHILE + 1;
+	outBytes(&c, 1);
+	for(code = END; code <= WHILE; code++) outBytes(getTokenCode(code), strlen(getTokenCode(code)) + 1);
 	for(currentToken = firstToken; currentToken != NULL; currentToken = currentToken->next)
 	{
-		printf(" %d %s ", currentToken->line, getTokenCode((currentToken->code)));
-		switch(currentToken->code)
+		code = currentToken->code;
+		c = (char)code;
+		outBytes(&c, 1);
+		outU32(currentToken->line);
+		outU32(0);
+		outU32(0);
+		switch(code)
 		{
-			case ID: printf(" :  %s", currentToken->text);
-			         break;
-			case CT_INT: printf(" :  %ld", currentToken->i);
-				     break;
-			case CT_CHAR: printf(" :  %c", currentToken->i);
+			case ID:
+			case CT_STRING: n = strlen(currentToken->text);
+					outU32(n);
+					outBytes(currentToken->text, n);
+					break;
+			case CT_INT:
+			case CT_CHAR: outU64((unsigned long long)currentToken->i);
 				      break;
-			case CT_REAL: printf(" :  %g", currentToken->r);
+			case CT_REAL: memcpy(&bits, &currentToken->r, sizeof(bits));
+				      outU64(bits);
 				      break;
-			case CT_STRING:	printf(" :  %s", currentToken->text);
-					break;
 
 			default : break;
 		}
-		printf("\n");
 	}
+	outFlush();
 }
 
 void tkerr(const Token *tk,const char *fmt, ...)
 {
 	va_list va;
+	if(stopPoint) longjmp(*stopPoint, 1);
 	va_start(va,fmt);
 	fprintf(stderr,"error in line %d: ",tk->line);
 	vfprintf(stderr,fmt,va);
@@ -149,41 +363,155 @@ void tkerr(const Token *tk,const char *fmt, ...)
 	exit(-1);
 }
 
+// the character an escape sequence \ch stands for; invalid ones (already reported) keep ch
+char escapeCharacter(char ch)
+{
+	static const char escapes[256] = {['a'] = '\a', ['b'] = '\b', ['f'] = '\f', ['n'] = '\n',
+		['r'] = '\r', ['t'] = '\t', ['v'] = '\v', ['?'] = '\?', ['"'] = '\"', ['\''] = '\'',
+		['\\'] = '\\'};
+	char c = escapes[(unsigned char)ch];
+	return c || ch == '0' ? c : ch;
+}
+
+// the slot of the string s (length bytes, with that hash), or the free one where it would go
+StringSlot *findString(char *s, int length, unsigned hash)
+{
+	StringSlot *slot;
+	unsigned i;
+	for(i = hash; ; i++)
+	{
+		slot = &stringSlots[i & (nStringSlots - 1)];
+		if(slot->s == NULL) return slot;
+		if(slot->hash == hash && slot->length == length && !memcmp(slot->s, s, length)) return slot;
+	}
+}
+
+// doubles the hash table once it is half full
+void growStrings()
+{
+	StringSlot *old = stringSlots, *slot;
+	int n = nStringSlots, i;
+	if(2 * (nStrings + 1) <= n) return;
+	nStringSlots = n ? 2 * n : 256;
+	if((stringSlots = (StringSlot*)calloc(nStringSlots, sizeof(StringSlot))) == NULL) err("not enough memory");
+	for(i = 0; i < n; i++)
+	{
+		if(old[i].s == NULL) continue;
+		slot = findString(old[i].s, old[i].length, old[i].hash);
+		*slot = old[i];
+	}
+	free(old);
+}
+
+// the text startCh..endCh with its escape sequences decoded, from the string pool: it is
+// decoded and hashed in one pass into the free space of the first block, which it only
+// keeps when the same string is not in the pool already
 char *createString(char *startCh, char *endCh)
 {
-    char *result = (char*)malloc((endCh-startCh)*sizeof(char));
-    int index = 0;
-    char aux;
-
-    while((endCh-startCh) > 0)
-    {
-        aux = startCh[1];
-		if((*startCh) == '\\')
+	StringBlock *b = stringBlocks;
+	StringSlot *slot;
+	int size = endCh - startCh + 1;
+	unsigned hash = 2166136261u;
+	char *s, *q, c;
+
+	if(b == NULL || b->size - b->used < size)
+	{
+		if(size < STRING_BLOCK) size = STRING_BLOCK;
+		if((b = (StringBlock*)malloc(sizeof(StringBlock) + size)) == NULL) err("not enough memory");
+		b->next = stringBlocks;
+		b->size = size;
+		b->used = 0;
+		stringBlocks = b;
+	}
+	s = q = b->data + b->used;
+	for(; startCh < endCh; startCh++)
+	{
+		c = *startCh;
+		if(c == '\\' && startCh + 1 < endCh) c = escapeCharacter(*++startCh);
+		*q++ = c;
+		hash = (hash ^ (unsigned char)c) * 16777619u;
+	}
+	*q = '\0';
+
+	growStrings();
+	slot = findString(s, q - s, hash);
+	if(slot->s == NULL)
+	{
+		slot->s = s;
+		slot->hash = hash;
+		slot->length = q - s;
+		nStrings++;
+		b->used += q - s + 1;
+	}
+	return slot->s;
+}
+
+// value of the digits start..end in base; CT_INT values are ints here, so *overflow
+// is set (and INT_MAX returned) when it does not fit in one
+long intValue(char *start, char *end, int base, int *overflow)
+{
+	long v = 0;
+	int d;
+	*overflow = 0;
+	for(; start < end; start++)
+	{
+		d = isdigit(*start) ? *start - '0' : tolower(*start) - 'a' + 10;
+		v = v * base + d;
+		if(v > INT_MAX)
 		{
-			if(aux == 'a') result[index] = '\a';
-			if(aux == 'b') result[index] = '\b';
-			if(aux == 'f') result[index] = '\f';
-			if(aux == 'n') result[index] = '\n';
-			if(aux == 'r') result[index] = '\r';
-			if(aux == 't') result[index] = '\t';
-			if(aux == 'v') result[index] = '\v';
-			if(aux == 'r') result[index] = '\r';
-			if(aux == '\'') result[index] = '\'';
-			if(aux == '?') result[index] = '\?';
-			if(aux == '"') result[index] = '\"';
-			if(aux == '\\') result[index] = '\\';
-			
-			if(!isalpha(aux)) result[index] = aux;
-			
-			startCh++;
+			*overflow = 1;
+			return INT_MAX;
 		}
-		else result[index] = *startCh;
-        index++;
-        startCh++;
-    }
-    result[index] = '\0';
+	}
+	return v;
+}
 
-    return result;
+// value of the real constant start..end, by Clinger's fast path: with at most 19 significant
+// digits and a value that is an integer below 2^53 times or over an exact power of 10, one
+// multiplication or division is correctly rounded; any other literal goes to strtod, on a
+// copy in a stack buffer when it is short
+double realValue(char *start, char *end)
+{
+	static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	unsigned long long m = 0;
+	char *p = start, copy[64];
+	int digits = 0, exp10 = 0, e = 0, negative = 0, fraction = 0;
+	for(; p < end && (isdigit(*p) || (*p == '.' && !fraction)); p++)
+	{
+		if(*p == '.')
+		{
+			fraction = 1;
+			continue;
+		}
+		if(m || *p != '0')
+		{
+			m = m * 10 + (*p - '0');
+			if(++digits > 19) break;
+		}
+		if(fraction) exp10--;
+	}
+	if(p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		if(p < end && (*p == '+' || *p == '-')) negative = *p++ == '-';
+		for(; p < end && e < 10000; p++) e = e * 10 + (*p - '0');
+		exp10 += negative ? -e : e;
+	}
+	if(p == end && m == 0) return 0;
+	if(p == end && m <= (1ULL << 53))
+	{
+		if(exp10 < 0 && exp10 >= -22) return (double)m / powers[-exp10];
+		for(; exp10 > 22 && m <= (1ULL << 53) / 10; exp10--) m *= 10;
+		if(exp10 >= 0 && exp10 <= 22) return (double)m * powers[exp10];
+	}
+	if(end - start < (int)sizeof(copy))
+	{
+		memcpy(copy, start, end - start);
+		copy[end - start] = '\0';
+		return strtod(copy, NULL);
+	}
+	return strtod(start, NULL);
 }
 
 int getNextToken()
@@ -192,6 +520,7 @@ int getNextToken()
 	int state = 0;
 	int lenChar;
 	int n;
+	int overflow;
 	int isHexFlag = 0;
 	int isOctFlag = 0;
 
@@ -356,8 +685,8 @@ int getNextToken()
 					}
 					else if(ch == '\0') return END;
 					else {
-						  perror("\nINVALID CHARACTER!\n");
-						  exit(-1);
+						lexError("INVALID CHARACTER!");
+						pCrtCh++;
 						 }
 					break;
 
@@ -386,8 +715,8 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER!\n");
-						exit(-1);
+						lexError("INVALID CHARACTER! DIGIT EXPECTED AFTER .");
+						state = 0;
 					}
 					break;
 
@@ -441,8 +770,8 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER!\n");
-						exit(-1);
+						lexError("INVALID CHARACTER IN EXPONENT!");
+						state = 0;
 					}
 					break;
 
@@ -452,11 +781,7 @@ int getNextToken()
 						pCrtCh++;
 						state = 55;
 					}
-					else
-					{
-						pCrtCh++;
-						state = 30;
-					}
+					else state = 30;
 					break;
 
 			case 8: if(isdigit(ch)) pCrtCh++;
@@ -470,8 +795,8 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER AFTER +/- !\n");
-						exit(-1);
+						lexError("INVALID CHARACTER AFTER +/- !");
+						state = 0;
 					}
 					break;
 
@@ -480,11 +805,7 @@ int getNextToken()
 						pCrtCh++;
 						state = 32;
 					}
-					else
-					{
-						pCrtCh++;
-						state = 31;
-					}
+					else state = 31;
 					break;
 
 			case 11: if((isdigit(ch)) || (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F'))
@@ -494,8 +815,8 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER IN BASE 16! CH BETWEEN 0-F!\n");
-						exit(-1);
+						lexError("INVALID CHARACTER IN BASE 16! CH BETWEEN 0-F!");
+						state = 0;
 					}
 					break;
 
@@ -510,8 +831,14 @@ int getNextToken()
 					}
 					else if(ch == '\'')
 					{
-					 	perror("\nYOU CAN'T HAVE AN EMPTY CHARACTER\n");
-						exit(-1);
+						lexError("YOU CAN'T HAVE AN EMPTY CHARACTER");
+						pCrtCh++;
+						state = 0;
+					}
+					else if(ch == '\0')
+					{
+						lexError("UNTERMINATED CHARACTER CONSTANT!");
+						state = 0;
 					}
 					else
 					{
@@ -521,23 +848,13 @@ int getNextToken()
 					}
 					break;
 
-			case 14: switch(ch)
-					 {
-					case 'a': prevChar = '\a'; break;
-					case 'b': prevChar = '\b'; break;
-					case 'f': prevChar = '\f'; break;
-					case 'n': prevChar = '\n'; break;
-					case 'r': prevChar = '\r'; break;
-					case 't': prevChar = '\t'; break;
-					case 'v': prevChar = '\v'; break;
-					case '\\': prevChar = '\\'; break;
-					case '"': prevChar = '\"'; break;
-					case '\'': prevChar = '\''; break;
-					case '?': prevChar = '\?'; break;
-					case '0': prevChar = '\0'; break;
-
-					default:prevChar = ch;
+			case 14: if(ch == '\0')
+					{
+						lexError("UNTERMINATED CHARACTER CONSTANT!");
+						state = 0;
+						break;
 					}
+					prevChar = escapeCharacter(ch);
 
 					pCrtCh++;
 					state = 15;
@@ -550,8 +867,8 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nToo many characters!\n");
-						exit(-1);
+						lexError("Too many characters!");
+						state = 0;
 					}
 					break;
 
@@ -561,10 +878,16 @@ int getNextToken()
 						state = 17;
 					}
 					else if(ch == '\"') state = 37;
+					else if(ch == '\0')
+					{
+						lexError("UNTERMINATED STRING!");
+						state = 0;
+					}
 					else pCrtCh++;
 					break;
 
-			case 17: if(ch == 'a' || ch == 'n' || ch == 'f' || ch == 'r' || ch == 't' ||
+			case 17: if(ch == '\0') state = 16;
+					else if(ch == 'a' || ch == 'n' || ch == 'f' || ch == 'r' || ch == 't' ||
 					    ch == 'v' || ch == '\'' || ch == '\"' || ch == '?' || ch == '\\' || ch == '0')
 					{
 						pCrtCh++;
@@ -572,8 +895,9 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER!\n");
-						exit(-1);
+						lexError("INVALID ESCAPE SEQUENCE!");
+						pCrtCh++;
+						state = 16;
 					}
 					break;
 
@@ -594,12 +918,17 @@ int getNextToken()
 			case 19: if(ch != '\n' && ch != '\r' && ch != '\0') pCrtCh++;
 					else
 					{
-						pCrtCh++;
+						if(ch != '\0') pCrtCh++;
 						state = 0;
 					}
 					break;
 
-			case 20: if(ch != '*') pCrtCh++;
+			case 20: if(ch == '\0')
+					{
+						lexError("UNTERMINATED COMMENT!");
+						state = 0;
+					}
+					else if(ch != '*') pCrtCh++;
 					else if(ch == '*')
 					{
 						pCrtCh++;
@@ -607,12 +936,17 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER!\n");
-						exit(-1);
+						lexError("INVALID CHARACTER!");
+						state = 0;
 					}
 					break;
 
-			case 21: if(ch == '*') pCrtCh++;
+			case 21: if(ch == '\0')
+					{
+						lexError("UNTERMINATED COMMENT!");
+						state = 0;
+					}
+					else if(ch == '*') pCrtCh++;
 					else if(ch != '/')
 					{
 						pCrtCh++;
@@ -626,8 +960,8 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER!\n");
-						exit(-1);
+						lexError("INVALID CHARACTER!");
+						state = 0;
 					}
 					break;
 	
@@ -662,8 +996,8 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER!\n");
-						exit(-1);
+						lexError("INVALID CHARACTER! & EXPECTED");
+						state = 0;
 					}
 					break;
 
@@ -674,8 +1008,8 @@ int getNextToken()
 					}
 					else
 					{
-						perror("\nINVALID CHARACTER!\n");
-						exit(-1);
+						lexError("INVALID CHARACTER! | EXPECTED");
+						state = 0;
 					}
 					break;
 
@@ -695,8 +1029,7 @@ int getNextToken()
 					else
 					 {
 						tk = addTk(ID);
-						tk->text = (char*)malloc(pCrtCh - ptrStart + 1);
-						strcpy(tk->text,createString(ptrStart, pCrtCh));
+						tk->text = createString(ptrStart, pCrtCh);
 					 }
 					return ID;
 					break;
@@ -708,9 +1041,10 @@ int getNextToken()
 					return RBRACKET;
 					break;
 			case 30: tk = addTk(CT_INT);
-					if(isHexFlag == 1) tk->i=(int)strtol(createString(ptrStart+2, pCrtCh) , NULL, 16);	//converts to a long int according to the base value
-					else if(isOctFlag == 1) tk->i=(int)strtol(createString(ptrStart+1,pCrtCh), NULL, 8);
-					else tk->i = atoi(createString(ptrStart, pCrtCh));
+					if(isHexFlag == 1) tk->i = intValue(ptrStart+2, pCrtCh, 16, &overflow);
+					else if(isOctFlag == 1) tk->i = intValue(ptrStart+1, pCrtCh, 8, &overflow);
+					else tk->i = intValue(ptrStart, pCrtCh, 10, &overflow);
+					if(overflow) lexError("INTEGER CONSTANT TOO LARGE!");
 					return CT_INT;
 					break; 
 
@@ -723,7 +1057,8 @@ int getNextToken()
 					break;
 
 			case 33: tk = addTk(CT_REAL);
-					tk->r = atof(createString(ptrStart, pCrtCh));
+					tk->r = realValue(ptrStart, pCrtCh);
+					if(isinf(tk->r)) lexError("REAL CONSTANT TOO LARGE!");
 					return CT_REAL;
 					break;
 
@@ -741,8 +1076,7 @@ int getNextToken()
 					break;
 
 			case 37: tk = addTk(CT_STRING);
-					tk->text = (char*)malloc(pCrtCh - ptrStart + 1);
-					strcpy(tk->text,createString(ptrStart+1, pCrtCh));
+					tk->text = createString(ptrStart+1, pCrtCh);
 					pCrtCh++;
 					return CT_STRING;
 					break;
@@ -828,8 +1162,8 @@ int getNextToken()
 					else if (isdigit(ch)) pCrtCh++;
 					else
 					{
-						perror("\nINVALID CHARACTER!\n");
-						exit(-1);
+						lexError("INVALID CHARACTER IN OCTAL NUMBER!");
+						state = 0;
 					}
 					break;
 
@@ -841,6 +1175,7 @@ int getNextToken()
 	}
 }
 
+#ifndef LEXER_LIBRARY
 int main(int argc, char **argv)
 {
 	char *text = (char*)malloc(MAX);
@@ -859,11 +1194,39 @@ int main(int argc, char **argv)
 	printf("%s\n", text);
 	
 	pCrtCh = text;
-
-	while(getNextToken() != END);
-
 	close(fd);
-	displayTokens();
 
+	if(argc > 2)		// optional second argument: file for the binary token dump
+	{
+		FILE *dump;
+		while(getNextToken() != END);
+		displayTokens();
+		dump = fopen(argv[2], "wb");
+		if(dump == NULL)
+		{
+			perror("\n Could not create the dump file! \n");
+			exit(-2);
+		}
+		dumpTokens(dump);
+		fclose(dump);
+	}
+	else
+	{
+		// the listing needs one token at a time: each is printed and freed before the next is read
+		outFile = stdout;
+		while(getNextToken() != END)
+		{
+			displayToken(lastToken);
+			freeTokens();
+		}
+		outFlush();
+	}
+
+	if(nErrors)
+	{
+		printErrors();
+		return -1;
+	}
 	return 0;
 }
+#endif
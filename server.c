@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "compiler.h"
+
+// Compile server: keeps the results of previous checks and answers requests
+// on a unix socket. Protocol, one request per connection:
+//     check <path>\n
+// The reply is the diagnostics, one per line, followed by "ok\n" or "errors <n>\n".
+// A file whose contents did not change since its last check, nor those of the files
+// it imports, is answered from the cache without lexing or parsing it again.
+// With a trace file, every request adds its phases to it, with one thread id per
+// connection.
+
+#define CACHE_SIZE 256
+#define MAX_REQUEST 4096
+
+typedef struct _CacheEntry{
+    char *path;
+    unsigned long long hash;        // of the file contents
+    long size;
+    char *reply;
+    Import *deps;                   // what its imports read, with the hashes they had
+    int nDeps;
+    struct _CacheEntry *next;
+} CacheEntry;
+
+CacheEntry *cache[CACHE_SIZE];
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+Trace *trace;
+int nextTid;
+
+void freeDeps(Import *deps, int n) {
+    int i;
+    for(i = 0; deps && i < n; i++) free(deps[i].path);
+    free(deps);
+}
+
+// A malloc'ed copy of n imports; NULL when n is 0 or memory runs out.
+Import *copyDeps(const Import *deps, int n) {
+    Import *copy;
+    int i;
+    if(n == 0 || (copy = (Import*)calloc(n, sizeof(Import))) == NULL) return NULL;
+    for(i = 0; i < n; i++) {
+        copy[i].hash = deps[i].hash;
+        if((copy[i].path = strdup(deps[i].path)) == NULL) {
+            freeDeps(copy, i);
+            return NULL;
+        }
+    }
+    return copy;
+}
+
+// Whether every file in deps still hashes as it did.
+int depsUnchanged(Import *deps, int n) {
+    char *text;
+    long size;
+    int i, same;
+    for(i = 0; i < n; i++) {
+        if((text = readFile(deps[i].path, &size)) == NULL) return 0;
+        same = hashBytes(text, size) == deps[i].hash;
+        free(text);
+        if(!same) return 0;
+    }
+    return 1;
+}
+
+// Runs the front end on text and returns the reply to send back (malloc'ed), and in
+// *deps the *nDeps files its imports read (NULL if they could not be copied).
+char *check(const char *path, char *text, int tid, Import **deps, int *nDeps) {
+    Context *ctx;
+    char *reply, *p;
+    int res, i, len = 32;
+    *deps = NULL;
+    *nDeps = 0;
+    if((ctx = createContext()) == NULL) return strdup("error: not enough memory\n");
+    ctx->path = path;
+    ctx->trace = trace;
+    ctx->traceTid = tid;
+    ctx->traceFile = path;
+    res = streamTokens(ctx, text);
+    if(res == RES_OK || res == RES_ERRORS) res = unit(ctx);
+    for(i = 0; i < ctx->nErrors; i++) len += strlen(ctx->errors[i]);
+    if((reply = (char*)malloc(len)) != NULL) {
+        p = reply;
+        for(i = 0; i < ctx->nErrors; i++) p = stpcpy(p, ctx->errors[i]);
+        if(res == RES_OK) strcpy(p, "ok\n");
+        else sprintf(p, "errors %d\n", ctx->nErrors);
+    }
+    *deps = copyDeps(ctx->imports, ctx->nImports);
+    *nDeps = ctx->nImports;
+    freeContext(ctx);
+    return reply;
+}
+
+// Returns a copy of the reply for path, computing and caching it when the contents changed.
+char *checkFile(const char *path, int tid) {
+    CacheEntry *e;
+    char *text, *reply = NULL;
+    Import *deps = NULL;
+    long size;
+    int nDeps = 0;
+    unsigned long long h;
+    unsigned bucket;
+    double start = seconds();
+    if((text = readFile(path, &size)) == NULL) return strdup("error: cannot read file\n");
+    if(trace) traceEvent(trace, tid, "read", path, start, seconds());
+    h = hashBytes(text, size);
+    bucket = hashBytes(path, strlen(path)) % CACHE_SIZE;
+
+    pthread_mutex_lock(&cacheLock);
+    for(e = cache[bucket]; e != NULL; e = e->next) {
+        if(!strcmp(e->path, path)) break;
+    }
+    if(e && e->hash == h && e->size == size) {
+        reply = strdup(e->reply);
+        nDeps = e->nDeps;
+        deps = copyDeps(e->deps, nDeps);
+    }
+    pthread_mutex_unlock(&cacheLock);
+    // the files it imports are hashed outside the lock, from a copy of their list
+    if(reply && nDeps && (deps == NULL || !depsUnchanged(deps, nDeps))) {
+        free(reply);
+        reply = NULL;
+    }
+    freeDeps(deps, nDeps);
+    if(reply) {
+        free(text);
+        if(trace) traceEvent(trace, tid, "cached", path, start, seconds());
+        return reply;
+    }
+
+    reply = check(path, text, tid, &deps, &nDeps);
+    free(text);
+    if(reply == NULL || (nDeps && deps == NULL)) {
+        freeDeps(deps, nDeps);
+        return reply;
+    }
+
+    pthread_mutex_lock(&cacheLock);
+    for(e = cache[bucket]; e != NULL; e = e->next) {
+        if(!strcmp(e->path, path)) break;
+    }
+    if(e == NULL && (e = (CacheEntry*)calloc(1, sizeof(CacheEntry))) != NULL) {
+        e->path = strdup(path);
+        e->next = cache[bucket];
+        cache[bucket] = e;
+    }
+    if(e) {
+        free(e->reply);
+        e->reply = strdup(reply);
+        e->hash = h;
+        e->size = size;
+        freeDeps(e->deps, e->nDeps);
+        e->deps = deps;
+        e->nDeps = nDeps;
+    } else freeDeps(deps, nDeps);
+    pthread_mutex_unlock(&cacheLock);
+    return reply;
+}
+
+void *serveClient(void *arg) {
+    int fd = (int)(long)arg;
+    char request[MAX_REQUEST], *reply, *nl;
+    int n = 0, r, tid = __sync_add_and_fetch(&nextTid, 1);
+    while(n < MAX_REQUEST - 1 && (r = read(fd, request + n, MAX_REQUEST - 1 - n)) > 0) {
+        n += r;
+        if(memchr(request, '\n', n)) break;
+    }
+    request[n] = '\0';
+    if((nl = strchr(request, '\n')) != NULL) *nl = '\0';
+
+    if(!strncmp(request, "check ", 6)) reply = checkFile(request + 6, tid);
+    else reply = strdup("error: unknown request\n");
+    if(reply) {
+        if(write(fd, reply, strlen(reply)) < 0) {}
+        free(reply);
+    }
+    close(fd);
+    if(trace) fflush(trace->out);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+    int fd, client;
+
+    if(argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: %s <socket path> [trace file]\n", argv[0]);
+        return -1;
+    }
+    if(argc == 3 && (trace = openTrace(argv[2])) == NULL) {
+        perror("cannot create trace file");
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    unlink(argv[1]);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        perror("cannot listen on socket");
+        return -1;
+    }
+
+    while(1) {
+        if((client = accept(fd, NULL, NULL)) < 0) continue;
+        if(pthread_create(&thread, NULL, serveClient, (void*)(long)client) != 0) {
+            close(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}